@@ -0,0 +1,1008 @@
+/*
+ * bench.c - Record/replay benchmark for the Notify ingestion path.
+ *
+ * Record mode monitors the session bus and appends every
+ * org.freedesktop.Notifications.Notify call to a capture file. Replay mode
+ * feeds a capture file through the service pipeline without a live bus and
+ * reports throughput, per-stage latency and allocations per message. Capture
+ * stats mode runs a bus spy on the live bus and reports how many messages
+ * crossed its filter, to compare the capture modes. Stress mode runs the
+ * link scanner over bodies built to make a backtracking matcher blow up and
+ * checks that the characters it reads per byte stay flat as they grow. Menu changes mode
+ * counts the items-changed signals, and so the Changed messages on the bus,
+ * that common operations cause, and fails when there are more than needed.
+ * Aggregate mode starts private dbus-daemons, watches them all from this
+ * process and reports its memory and CPU use.
+ *
+ * Capture file format: a sequence of records, each a little-endian guint32
+ * length followed by that many bytes of serialized GDBusMessage.
+ */
+
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
+#include "service.h"
+#include "dbus-spy.h"
+#include "stats.h"
+#include "urlregex.h"
+
+#define MONITOR_MATCH_STRING "type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+#define EAVESDROP_MATCH_STRING "eavesdrop=true," MONITOR_MATCH_STRING
+
+/*
+ * Allocation counting. Overriding the allocator entry points in the
+ * executable catches every allocation made by GLib as well as by us.
+ */
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint m_nAllocations = 0;
+
+void *malloc (size_t size)
+{
+    g_atomic_int_inc (&m_nAllocations);
+
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+    g_atomic_int_inc (&m_nAllocations);
+
+    return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    g_atomic_int_inc (&m_nAllocations);
+
+    return __libc_realloc (ptr, size);
+}
+
+static gint getAllocations (void)
+{
+    return g_atomic_int_get (&m_nAllocations);
+}
+#else
+static gint getAllocations (void)
+{
+    return -1;
+}
+#endif
+
+/*
+ * Record
+ */
+
+typedef struct
+{
+    FILE *pFile;
+    GMainLoop *pLoop;
+    gint nWanted;
+    volatile gint nRecorded;
+} Recorder;
+
+static GDBusMessage *onRecordFilter (GDBusConnection *connection G_GNUC_UNUSED, GDBusMessage *message, gboolean incoming, gpointer user_data)
+{
+    Recorder *recorder = user_data;
+
+    if (!incoming
+        || g_dbus_message_get_message_type (message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL
+        || g_strcmp0 (g_dbus_message_get_interface (message), "org.freedesktop.Notifications") != 0
+        || g_strcmp0 (g_dbus_message_get_member (message), "Notify") != 0)
+    {
+        return message;
+    }
+
+    gsize nSize = 0;
+    guchar *blob = g_dbus_message_to_blob (message, &nSize, G_DBUS_CAPABILITY_FLAGS_NONE, NULL);
+
+    if (blob != NULL)
+    {
+        guint32 nLength = GUINT32_TO_LE ((guint32) nSize);
+
+        fwrite (&nLength, sizeof (nLength), 1, recorder->pFile);
+        fwrite (blob, 1, nSize, recorder->pFile);
+        fflush (recorder->pFile);
+        g_free (blob);
+
+        gint nRecorded = g_atomic_int_add (&recorder->nRecorded, 1) + 1;
+        g_print ("recorded %d\n", nRecorded);
+
+        if (recorder->nWanted > 0 && nRecorded >= recorder->nWanted)
+        {
+            g_main_loop_quit (recorder->pLoop);
+        }
+    }
+
+    g_object_unref (message);
+
+    return NULL;
+}
+
+static gboolean onRecordInterrupt (gpointer loop)
+{
+    g_main_loop_quit ((GMainLoop*) loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+static int record (const gchar *sPath, gint nWanted)
+{
+    GError *error = NULL;
+    Recorder recorder;
+    gchar *sAddress = g_dbus_address_get_for_bus_sync (G_BUS_TYPE_SESSION, NULL, &error);
+    GDBusConnection *connection = NULL;
+
+    if (sAddress != NULL)
+    {
+        connection = g_dbus_connection_new_for_address_sync (sAddress, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error);
+        g_free (sAddress);
+    }
+
+    if (connection == NULL)
+    {
+        g_printerr ("cannot connect to the session bus: %s\n", error->message);
+        g_error_free (error);
+
+        return EXIT_FAILURE;
+    }
+
+    recorder.pFile = fopen (sPath, "ab");
+
+    if (recorder.pFile == NULL)
+    {
+        g_printerr ("cannot open %s for writing\n", sPath);
+        g_object_unref (connection);
+
+        return EXIT_FAILURE;
+    }
+
+    recorder.pLoop = g_main_loop_new (NULL, FALSE);
+    recorder.nWanted = nWanted;
+    recorder.nRecorded = 0;
+
+    const gchar *lRules[] = { MONITOR_MATCH_STRING, NULL };
+
+    g_dbus_connection_add_filter (connection, onRecordFilter, &recorder, NULL);
+    GVariant *ret = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus.Monitoring", "BecomeMonitor", g_variant_new ("(^asu)", lRules, 0), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+
+    if (ret == NULL)
+    {
+        g_printerr ("cannot become a monitor (%s), eavesdropping instead\n", error->message);
+        g_clear_error (&error);
+        ret = g_dbus_connection_call_sync (connection, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch", g_variant_new ("(s)", EAVESDROP_MATCH_STRING), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    }
+
+    if (ret == NULL)
+    {
+        g_printerr ("cannot add match rule: %s\n", error->message);
+        g_error_free (error);
+    }
+    else
+    {
+        g_variant_unref (ret);
+        g_unix_signal_add (SIGINT, onRecordInterrupt, recorder.pLoop);
+        g_main_loop_run (recorder.pLoop);
+    }
+
+    g_dbus_connection_close_sync (connection, NULL, NULL);
+    g_object_unref (connection);
+    g_main_loop_unref (recorder.pLoop);
+    fclose (recorder.pFile);
+
+    g_print ("%d messages written to %s\n", g_atomic_int_get (&recorder.nRecorded), sPath);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Capture stats
+ */
+
+static int captureStats (const gchar *sMode, guint nSeconds)
+{
+    DBusSpyCaptureMode nMode;
+
+    if (g_strcmp0 (sMode, "auto") == 0)
+    {
+        nMode = DBUS_SPY_CAPTURE_AUTO;
+    }
+    else if (g_strcmp0 (sMode, "monitor") == 0)
+    {
+        nMode = DBUS_SPY_CAPTURE_MONITOR;
+    }
+    else if (g_strcmp0 (sMode, "eavesdrop") == 0)
+    {
+        nMode = DBUS_SPY_CAPTURE_EAVESDROP;
+    }
+    else
+    {
+        g_printerr ("unknown capture mode '%s'\n", sMode);
+
+        return EXIT_FAILURE;
+    }
+
+    GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+    DBusSpy *spy = dbus_spy_new_with_mode (nMode);
+    guint nNotifies = 0;
+
+    g_timeout_add_seconds (nSeconds, onRecordInterrupt, loop);
+    g_unix_signal_add (SIGINT, onRecordInterrupt, loop);
+    g_main_loop_run (loop);
+
+    guint nMessages = dbus_spy_get_messages_seen (spy, &nNotifies);
+
+    g_print ("capture mode:  %s (%s)\n", sMode, dbus_spy_is_monitoring (spy) ? "monitor" : "eavesdrop");
+    g_print ("filter calls:  %u\n", nMessages);
+    g_print ("notify calls:  %u\n", nNotifies);
+
+    g_object_unref (spy);
+    g_main_loop_unref (loop);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Replay
+ */
+
+typedef struct
+{
+    gint64 *lSamples;
+    guint nSamples;
+    guint nCapacity;
+} StageSamples;
+
+static void onStage (StatsStage stage, gint64 elapsed_ns, gpointer user_data)
+{
+    StageSamples *samples = &((StageSamples *) user_data)[stage];
+
+    if (samples->nSamples < samples->nCapacity)
+    {
+        samples->lSamples[samples->nSamples++] = elapsed_ns;
+    }
+}
+
+static gint compareSamples (gconstpointer a, gconstpointer b)
+{
+    gint64 nA = *(const gint64 *) a;
+    gint64 nB = *(const gint64 *) b;
+
+    return (nA > nB) - (nA < nB);
+}
+
+static gdouble percentile (const StageSamples *samples, gdouble fRank)
+{
+    if (samples->nSamples == 0)
+    {
+        return 0.0;
+    }
+
+    guint nIndex = (guint) (fRank * (samples->nSamples - 1));
+
+    return samples->lSamples[nIndex] / 1000.0;
+}
+
+static GPtrArray *loadCapture (const gchar *sPath)
+{
+    GError *error = NULL;
+    gchar *contents = NULL;
+    gsize nLength = 0;
+
+    if (!g_file_get_contents (sPath, &contents, &nLength, &error))
+    {
+        g_printerr ("cannot read %s: %s\n", sPath, error->message);
+        g_error_free (error);
+
+        return NULL;
+    }
+
+    GPtrArray *lMessages = g_ptr_array_new_with_free_func (g_object_unref);
+    gsize nOffset = 0;
+
+    while (nOffset + sizeof (guint32) <= nLength)
+    {
+        guint32 nSize;
+
+        memcpy (&nSize, contents + nOffset, sizeof (nSize));
+        nSize = GUINT32_FROM_LE (nSize);
+        nOffset += sizeof (nSize);
+
+        if (nSize > nLength - nOffset)
+        {
+            g_printerr ("truncated record at offset %" G_GSIZE_FORMAT ", ignoring the rest\n", nOffset);
+
+            break;
+        }
+
+        GDBusMessage *message = g_dbus_message_new_from_blob ((guchar *) contents + nOffset, nSize, G_DBUS_CAPABILITY_FLAGS_NONE, &error);
+
+        if (message == NULL)
+        {
+            g_printerr ("skipping bad record at offset %" G_GSIZE_FORMAT ": %s\n", nOffset, error->message);
+            g_clear_error (&error);
+        }
+        else
+        {
+            g_ptr_array_add (lMessages, message);
+        }
+
+        nOffset += nSize;
+    }
+
+    g_free (contents);
+
+    return lMessages;
+}
+
+static int replay (const gchar *sPath, guint nIterations)
+{
+    GPtrArray *lMessages = loadCapture (sPath);
+
+    if (lMessages == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (lMessages->len == 0)
+    {
+        g_printerr ("%s contains no messages\n", sPath);
+        g_ptr_array_unref (lMessages);
+
+        return EXIT_FAILURE;
+    }
+
+    guint nTotal = lMessages->len * nIterations;
+    StageSamples lStages[STATS_N_STAGES];
+    guint nStage;
+
+    // Preallocate so that sample collection does not show up in the allocation count
+    for (nStage = 0; nStage < STATS_N_STAGES; nStage++)
+    {
+        lStages[nStage].lSamples = g_new0 (gint64, nTotal);
+        lStages[nStage].nSamples = 0;
+        lStages[nStage].nCapacity = nTotal;
+    }
+
+    // The memory settings backend is shared by the process, this keeps the replay off the user's disk
+    GSettings *pSettings = g_settings_new ("org.ayatana.indicator.notifications");
+    g_settings_set_boolean (pSettings, "persist-history", FALSE);
+    // Replay runs much faster than the capture was recorded, rate limiting would fold most of it away
+    g_settings_set_int (pSettings, "rate-limit-burst", 0);
+    // Replay does not wait for menu frames, so every batch goes to the menu as it is handled
+    g_settings_set_int (pSettings, "menu-frame-interval", 0);
+    g_object_unref (pSettings);
+
+    IndicatorNotificationsService *service = indicator_notifications_service_new ();
+
+    // Let the start-up work (settings, failed bus connection) settle before measuring
+    while (g_main_context_iteration (NULL, FALSE));
+
+    stats_set_stage_func (onStage, lStages);
+
+    guint nPrefilterHitsStart, nPrefilterSkipsStart;
+    urlregex_get_prefilter_stats (&nPrefilterHitsStart, &nPrefilterSkipsStart);
+
+    gint nAllocationsStart = getAllocations ();
+    gint64 nStart = g_get_monotonic_time ();
+    guint nIteration;
+    guint nMessage;
+
+    for (nIteration = 0; nIteration < nIterations; nIteration++)
+    {
+        for (nMessage = 0; nMessage < lMessages->len; nMessage++)
+        {
+            indicator_notifications_service_inject_message (service, g_ptr_array_index (lMessages, nMessage));
+        }
+
+        while (g_main_context_iteration (NULL, FALSE));
+    }
+
+    gint64 nElapsed = g_get_monotonic_time () - nStart;
+    gint nAllocations = getAllocations () - nAllocationsStart;
+
+    stats_set_stage_func (NULL, NULL);
+
+    g_print ("messages:      %u (%u x %u)\n", nTotal, lMessages->len, nIterations);
+    g_print ("elapsed:       %.3f ms\n", nElapsed / 1000.0);
+    g_print ("throughput:    %.0f messages/s\n", nElapsed > 0 ? nTotal * (G_USEC_PER_SEC / (gdouble) nElapsed) : 0.0);
+
+    if (nAllocationsStart >= 0)
+    {
+        g_print ("allocations:   %.1f per message\n", nAllocations / (gdouble) nTotal);
+    }
+
+    guint nHighWater;
+    guint nDropped = indicator_notifications_service_get_queue_stats (service, &nHighWater);
+    g_print ("queue:         %u dropped, high water %u\n", nDropped, nHighWater);
+
+    guint nPrefilterHits, nPrefilterSkips;
+    urlregex_get_prefilter_stats (&nPrefilterHits, &nPrefilterSkips);
+    nPrefilterHits -= nPrefilterHitsStart;
+    nPrefilterSkips -= nPrefilterSkipsStart;
+
+    if (nPrefilterHits + nPrefilterSkips > 0)
+    {
+        g_print ("link scans:    %u scanned (%.1f%%), %u skipped (%.1f%%)\n", nPrefilterHits, 100.0 * nPrefilterHits / (nPrefilterHits + nPrefilterSkips), nPrefilterSkips, 100.0 * nPrefilterSkips / (nPrefilterHits + nPrefilterSkips));
+    }
+
+    g_print ("\n%-8s %8s %10s %10s %10s %10s\n", "stage", "samples", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+
+    for (nStage = 0; nStage < STATS_N_STAGES; nStage++)
+    {
+        StageSamples *samples = &lStages[nStage];
+
+        qsort (samples->lSamples, samples->nSamples, sizeof (gint64), compareSamples);
+        g_print ("%-8s %8u %10.2f %10.2f %10.2f %10.2f\n", stats_stage_name (nStage), samples->nSamples, percentile (samples, 0.50), percentile (samples, 0.90), percentile (samples, 0.99), percentile (samples, 1.0));
+        g_free (samples->lSamples);
+    }
+
+    g_clear_object (&service);
+    g_ptr_array_unref (lMessages);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stress
+ */
+
+typedef struct
+{
+    const gchar *sName;
+    const gchar *sPrefix;
+    const gchar *sRepeat;
+    const gchar *sMiddle;
+} StressPattern;
+
+// Each body is the prefix followed by the repeated part, with the middle part halfway through, so nothing closes the match
+static const StressPattern m_lStressPatterns[] =
+{
+    { "slashes", "http://example.com", "/", "" },
+    { "parens", "http://example.com/", "((a)", "" },
+    { "userpass", "http://", "a:b:", "" },
+    { "schemes", "", "http://", "" },
+    { "hosts", "www", ".a", "" },
+    { "ats", "", "a@", "" },
+    { "userat", "", "a", "@" },
+    { "dots", "", "a.", "" },
+    { "alnum", "", "a", "" },
+    { "links", "", "see http://a.b/c(d) ", "" }
+};
+
+static int stress (guint nMaxSize)
+{
+    GArray *lSpans = g_array_new (FALSE, FALSE, sizeof (UrlSpan));
+    gboolean bFlat = TRUE;
+    guint nPattern;
+
+    g_print ("%-10s %10s %10s %10s %8s %8s\n", "pattern", "bytes", "ns/byte", "steps/byte", "spans", "budget");
+
+    for (nPattern = 0; nPattern < G_N_ELEMENTS (m_lStressPatterns); nPattern++)
+    {
+        const StressPattern *pattern = &m_lStressPatterns[nPattern];
+        gdouble fFirst = 0.0;
+        guint nSize;
+
+        for (nSize = 1024; nSize <= nMaxSize; nSize *= 4)
+        {
+            GString *body = g_string_new (pattern->sPrefix);
+            guint nHits = urlregex_get_budget_hits ();
+            guint nRounds = MAX (nMaxSize / nSize, 1);
+            guint nRound;
+            guint nSpans = 0;
+
+            while (body->len < nSize / 2)
+            {
+                g_string_append (body, pattern->sRepeat);
+            }
+
+            g_string_append (body, pattern->sMiddle);
+
+            while (body->len < nSize)
+            {
+                g_string_append (body, pattern->sRepeat);
+            }
+
+            gint64 nStart = g_get_monotonic_time ();
+
+            for (nRound = 0; nRound < nRounds; nRound++)
+            {
+                g_array_set_size (lSpans, 0);
+                nSpans = urlregex_scan (body->str, body->len, lSpans);
+            }
+
+            gint64 nElapsed = g_get_monotonic_time () - nStart;
+            gdouble fPerByte = nElapsed * 1000.0 / ((gdouble) body->len * nRounds);
+
+            // The budget caps the time spent on a body, so count the steps without it
+            gdouble fStepsPerByte = (gdouble) urlregex_count_steps (body->str, body->len) / body->len;
+
+            g_print ("%-10s %10" G_GSIZE_FORMAT " %10.2f %10.2f %8u %8s\n", pattern->sName, body->len, fPerByte, fStepsPerByte, nSpans, urlregex_get_budget_hits () != nHits ? "hit" : "-");
+
+            // Steps do not depend on timer noise, so only allow for the fixed prefix and middle
+            if (fFirst == 0.0)
+            {
+                fFirst = fStepsPerByte;
+            }
+            else if (fStepsPerByte > fFirst * 2)
+            {
+                bFlat = FALSE;
+            }
+
+            g_string_free (body, TRUE);
+        }
+    }
+
+    g_print ("\nbudget hits:   %u\n", urlregex_get_budget_hits ());
+    g_array_unref (lSpans);
+
+    if (!bFlat)
+    {
+        g_printerr ("steps per byte grow with the body size\n");
+
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Menu changes
+ */
+
+static void onItemsChanged (GMenuModel *model G_GNUC_UNUSED, gint position G_GNUC_UNUSED, gint removed G_GNUC_UNUSED, gint added G_GNUC_UNUSED, gpointer user_data)
+{
+    guint *nChanges = user_data;
+
+    (*nChanges)++;
+}
+
+// Each items-changed signal becomes one Changed message from the menu exporter
+static void watchMenu (GMenuModel *model, guint *nChanges)
+{
+    gint nItems = g_menu_model_get_n_items (model);
+    gint i;
+
+    g_signal_connect (model, "items-changed", G_CALLBACK (onItemsChanged), nChanges);
+
+    for (i = 0; i < nItems; i++)
+    {
+        GMenuLinkIter *iter = g_menu_model_iterate_item_links (model, i);
+        GMenuModel *link;
+
+        while (g_menu_link_iter_get_next (iter, NULL, &link))
+        {
+            watchMenu (link, nChanges);
+            g_object_unref (link);
+        }
+
+        g_object_unref (iter);
+    }
+}
+
+static GDBusMessage *newNotify (const gchar *sSummary)
+{
+    GDBusMessage *message = g_dbus_message_new_method_call ("org.freedesktop.Notifications", "/org/freedesktop/Notifications", "org.freedesktop.Notifications", "Notify");
+
+    g_dbus_message_set_body (message, g_variant_new ("(susssasa{sv}i)", "bench", 0, "", sSummary, "body", NULL, NULL, -1));
+
+    return message;
+}
+
+typedef struct
+{
+    const gchar *sName;
+    guint nExpected;
+} MenuOperation;
+
+static const MenuOperation m_lMenuOperations[] =
+{
+    { "insert", 1 },
+    { "dnd", 0 },
+    { "clear", 1 }
+};
+
+#define BURST_SIZE 200
+#define BURST_FRAME_INTERVAL 50
+
+static gboolean onTimeout (gpointer user_data)
+{
+    gboolean *bDone = user_data;
+
+    *bDone = TRUE;
+
+    return G_SOURCE_REMOVE;
+}
+
+// Runs the main loop, timers included, for a while
+static void runFor (guint nMilliseconds)
+{
+    gboolean bDone = FALSE;
+
+    g_timeout_add (nMilliseconds, onTimeout, &bDone);
+
+    while (!bDone)
+    {
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static int menuChanges (void)
+{
+    GSettings *pSettings = g_settings_new ("org.ayatana.indicator.notifications");
+    g_settings_set_boolean (pSettings, "persist-history", FALSE);
+    g_settings_set_int (pSettings, "rate-limit-burst", 0);
+    g_settings_set_int (pSettings, "menu-frame-interval", BURST_FRAME_INTERVAL);
+    g_object_unref (pSettings);
+
+    IndicatorNotificationsService *service = indicator_notifications_service_new ();
+    GActionGroup *actions = indicator_notifications_service_get_actions (service);
+    gboolean bMinimal = TRUE;
+    guint nChanges = 0;
+    guint nOperation;
+
+    while (g_main_context_iteration (NULL, FALSE));
+
+    watchMenu (indicator_notifications_service_get_menu (service), &nChanges);
+
+    g_print ("%-8s %8s %8s\n", "change", "signals", "expected");
+
+    for (nOperation = 0; nOperation < G_N_ELEMENTS (m_lMenuOperations); nOperation++)
+    {
+        const MenuOperation *operation = &m_lMenuOperations[nOperation];
+
+        nChanges = 0;
+
+        if (g_str_equal (operation->sName, "insert"))
+        {
+            GDBusMessage *message = newNotify ("summary");
+
+            indicator_notifications_service_inject_message (service, message);
+            g_object_unref (message);
+        }
+        else if (g_str_equal (operation->sName, "dnd"))
+        {
+            if (g_action_group_has_action (actions, "do-not-disturb"))
+            {
+                g_action_group_change_action_state (actions, "do-not-disturb", g_variant_new_boolean (TRUE));
+            }
+        }
+        else
+        {
+            g_action_group_activate_action (actions, "clear-notifications", NULL);
+        }
+
+        while (g_main_context_iteration (NULL, FALSE));
+
+        g_print ("%-8s %8u %8u\n", operation->sName, nChanges, operation->nExpected);
+
+        if (nChanges > operation->nExpected)
+        {
+            bMinimal = FALSE;
+        }
+    }
+
+    // A burst of separate batches, as a flood of notifications arrives, is shown once per frame
+    guint nBurst;
+    gint64 nStart = g_get_monotonic_time ();
+
+    nChanges = 0;
+
+    for (nBurst = 0; nBurst < BURST_SIZE; nBurst++)
+    {
+        gchar *sSummary = g_strdup_printf ("burst %u", nBurst);
+        GDBusMessage *message = newNotify (sSummary);
+
+        indicator_notifications_service_inject_message (service, message);
+        g_object_unref (message);
+        g_free (sSummary);
+
+        while (g_main_context_iteration (NULL, FALSE));
+    }
+
+    // Each frame adds the new items and trims the old ones, and the first item may be shown on its own
+    guint nFrames = (g_get_monotonic_time () - nStart) / (BURST_FRAME_INTERVAL * 1000) + 1;
+    guint nExpected = 2 * nFrames + 1;
+
+    runFor (BURST_FRAME_INTERVAL * 3);
+
+    g_print ("%-8s %8u %8u\n", "burst", nChanges, nExpected);
+
+    if (nChanges > nExpected)
+    {
+        bMinimal = FALSE;
+    }
+
+    g_clear_object (&service);
+
+    if (!bMinimal)
+    {
+        g_printerr ("menu changes are not minimal\n");
+
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Aggregate
+ */
+
+static glong getRss (void)
+{
+    gchar *contents = NULL;
+    glong nRss = -1;
+
+    if (g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+    {
+        const gchar *line = strstr (contents, "VmRSS:");
+
+        if (line != NULL)
+        {
+            nRss = strtol (line + strlen ("VmRSS:"), NULL, 10);
+        }
+
+        g_free (contents);
+    }
+
+    return nRss;
+}
+
+static gint64 getCpuTime (void)
+{
+    struct rusage usage;
+
+    getrusage (RUSAGE_SELF, &usage);
+
+    return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Starts a private bus, returns its address and fills in the pid to stop it with
+static gchar *startBus (GPid *pPid)
+{
+    gchar *lArgs[] = { "dbus-daemon", "--session", "--fork", "--print-address=1", "--print-pid=1", NULL };
+    gchar *sOutput = NULL;
+    GError *error = NULL;
+    gint nStatus;
+
+    if (!g_spawn_sync (NULL, lArgs, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &sOutput, NULL, &nStatus, &error) || nStatus != 0)
+    {
+        g_printerr ("cannot start dbus-daemon: %s\n", error != NULL ? error->message : "failed");
+        g_clear_error (&error);
+        g_free (sOutput);
+
+        return NULL;
+    }
+
+    gchar **lLines = g_strsplit (sOutput, "\n", 3);
+    gchar *sAddress = NULL;
+
+    if (g_strv_length (lLines) >= 2)
+    {
+        sAddress = g_strdup (lLines[0]);
+        *pPid = atoi (lLines[1]);
+    }
+
+    g_strfreev (lLines);
+    g_free (sOutput);
+
+    return sAddress;
+}
+
+static void sendNotify (GDBusConnection *connection, guint nMessage)
+{
+    gchar *sSummary = g_strdup_printf ("aggregate %u", nMessage);
+    GDBusMessage *message = newNotify (sSummary);
+
+    // Nobody serves the name on a private bus, the spy only needs to see the call
+    g_dbus_message_set_destination (message, "org.freedesktop.Notifications");
+    g_dbus_message_set_flags (message, G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED);
+    g_dbus_connection_send_message (connection, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+    g_object_unref (message);
+    g_free (sSummary);
+}
+
+static int aggregate (guint nBuses, guint nPerBus)
+{
+    GPtrArray *lServices = g_ptr_array_new_with_free_func (g_object_unref);
+    GPtrArray *lClients = g_ptr_array_new_with_free_func (g_object_unref);
+    GArray *lPids = g_array_new (FALSE, FALSE, sizeof (GPid));
+    int nResult = EXIT_SUCCESS;
+    guint i;
+    guint j;
+
+    GSettings *pSettings = g_settings_new ("org.ayatana.indicator.notifications");
+    g_settings_set_boolean (pSettings, "persist-history", FALSE);
+    g_settings_set_int (pSettings, "rate-limit-burst", 0);
+    g_object_unref (pSettings);
+
+    glong nRssStart = getRss ();
+
+    for (i = 0; i < nBuses; i++)
+    {
+        GPid nPid = 0;
+        gchar *sAddress = startBus (&nPid);
+        GError *error = NULL;
+
+        if (sAddress == NULL)
+        {
+            nResult = EXIT_FAILURE;
+
+            break;
+        }
+
+        g_array_append_val (lPids, nPid);
+        g_ptr_array_add (lServices, indicator_notifications_service_new_for_address (sAddress));
+
+        GDBusConnection *connection = g_dbus_connection_new_for_address_sync (sAddress, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, &error);
+
+        g_free (sAddress);
+
+        if (connection == NULL)
+        {
+            g_printerr ("cannot connect to a private bus: %s\n", error->message);
+            g_error_free (error);
+            nResult = EXIT_FAILURE;
+
+            break;
+        }
+
+        g_ptr_array_add (lClients, connection);
+    }
+
+    if (nResult == EXIT_SUCCESS)
+    {
+        // Let the spies become monitors and the services own their names
+        runFor (500);
+
+        glong nRssIdle = getRss ();
+        guint nReceivedStart = stats_get_count (STATS_COUNTER_RECEIVED);
+        guint nExpected = nBuses * nPerBus;
+        gint64 nCpuStart = getCpuTime ();
+        gint64 nStart = g_get_monotonic_time ();
+
+        for (j = 0; j < nPerBus; j++)
+        {
+            for (i = 0; i < lClients->len; i++)
+            {
+                sendNotify (g_ptr_array_index (lClients, i), j);
+            }
+        }
+
+        while (stats_get_count (STATS_COUNTER_RECEIVED) - nReceivedStart < nExpected && g_get_monotonic_time () - nStart < 10 * G_USEC_PER_SEC)
+        {
+            runFor (10);
+        }
+
+        // Let the last batches and menu frames through
+        runFor (200);
+
+        gint64 nCpu = getCpuTime () - nCpuStart;
+        guint nReceived = stats_get_count (STATS_COUNTER_RECEIVED) - nReceivedStart;
+
+        g_print ("buses:         %u\n", nBuses);
+        g_print ("received:      %u of %u\n", nReceived, nExpected);
+        g_print ("rss:           %ld KiB idle, %ld KiB after, %.0f KiB per bus\n", nRssIdle, getRss (), (nRssIdle - nRssStart) / (gdouble) nBuses);
+        g_print ("cpu:           %.3f ms, %.2f us per message\n", nCpu / 1000.0, nReceived > 0 ? nCpu / (gdouble) nReceived : 0.0);
+        g_print ("\nrun with --aggregate 1 for the cost of a single service, as N separate processes each pay it\n");
+
+        if (nReceived < nExpected)
+        {
+            g_printerr ("not every notification was seen\n");
+            nResult = EXIT_FAILURE;
+        }
+    }
+
+    g_ptr_array_unref (lServices);
+    g_ptr_array_unref (lClients);
+
+    for (i = 0; i < lPids->len; i++)
+    {
+        kill (g_array_index (lPids, GPid, i), SIGTERM);
+    }
+
+    g_array_unref (lPids);
+
+    return nResult;
+}
+
+int main (int argc, char **argv)
+{
+    gchar *sRecord = NULL;
+    gchar *sReplay = NULL;
+    gint nCount = 0;
+    gint nIterations = 1;
+    gchar *sCaptureMode = NULL;
+    gint nSeconds = 60;
+    gint nStressSize = 0;
+    gboolean bMenuChanges = FALSE;
+    gint nBuses = 0;
+    GError *error = NULL;
+    int nResult;
+
+    GOptionEntry lEntries[] =
+    {
+        { "record", 'r', 0, G_OPTION_ARG_FILENAME, &sRecord, "Append Notify messages seen on the session bus to FILE", "FILE" },
+        { "count", 'c', 0, G_OPTION_ARG_INT, &nCount, "Stop recording after N messages (default: until interrupted), or send N notifications to each bus in aggregate mode", "N" },
+        { "replay", 'p', 0, G_OPTION_ARG_FILENAME, &sReplay, "Replay the messages in FILE through the service pipeline", "FILE" },
+        { "iterations", 'i', 0, G_OPTION_ARG_INT, &nIterations, "Replay the capture N times (default: 1)", "N" },
+        { "capture-stats", 's', 0, G_OPTION_ARG_STRING, &sCaptureMode, "Count the messages a bus spy in MODE (auto, monitor or eavesdrop) has to look at", "MODE" },
+        { "seconds", 't', 0, G_OPTION_ARG_INT, &nSeconds, "Collect capture stats for N seconds (default: 60)", "N" },
+        { "stress", 'x', 0, G_OPTION_ARG_INT, &nStressSize, "Scan pathological bodies of up to N bytes for links", "N" },
+        { "menu-changes", 'm', 0, G_OPTION_ARG_NONE, &bMenuChanges, "Count the menu changes an insert, a do-not-disturb toggle, a clear and a burst cause", NULL },
+        { "aggregate", 'a', 0, G_OPTION_ARG_INT, &nBuses, "Watch N private buses from this process and send notifications to each", "N" },
+        { NULL }
+    };
+
+    setlocale (LC_ALL, "");
+
+    GOptionContext *context = g_option_context_new ("- benchmark the notification ingestion path");
+    g_option_context_add_main_entries (context, lEntries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+
+        return EXIT_FAILURE;
+    }
+
+    g_option_context_free (context);
+
+    if (sReplay != NULL || bMenuChanges || nBuses > 0)
+    {
+        // Replay, menu changes and aggregate must not touch the user's bus or settings
+        g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+        g_setenv ("GSETTINGS_SCHEMA_DIR", BENCH_SCHEMA_DIR, FALSE);
+        g_setenv ("DBUS_SESSION_BUS_ADDRESS", "unix:path=/nonexistent", TRUE);
+    }
+
+    if (sRecord != NULL)
+    {
+        nResult = record (sRecord, nCount);
+    }
+    else if (sReplay != NULL)
+    {
+        nResult = replay (sReplay, MAX (nIterations, 1));
+    }
+    else if (sCaptureMode != NULL)
+    {
+        nResult = captureStats (sCaptureMode, MAX (nSeconds, 1));
+    }
+    else if (nStressSize > 0)
+    {
+        nResult = stress (MAX (nStressSize, 1024));
+    }
+    else if (bMenuChanges)
+    {
+        nResult = menuChanges ();
+    }
+    else if (nBuses > 0)
+    {
+        nResult = aggregate (nBuses, nCount > 0 ? nCount : 1000);
+    }
+    else
+    {
+        g_printerr ("one of --record, --replay, --capture-stats, --stress, --menu-changes or --aggregate is required\n");
+        nResult = EXIT_FAILURE;
+    }
+
+    g_free (sRecord);
+    g_free (sReplay);
+    g_free (sCaptureMode);
+
+    return nResult;
+}
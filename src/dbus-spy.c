@@ -2,36 +2,55 @@
  * dbus-spy.c - A gobject subclass to watch dbus for org.freedesktop.Notification.Notify messages.
  */
 
+#include <string.h>
 #include "dbus-spy.h"
+#include "stats.h"
 
 enum {
-  MESSAGE_RECEIVED,
+  MESSAGES_RECEIVED,
+  NOTIFICATION_ACKNOWLEDGED,
   LAST_SIGNAL
 };
 
-typedef struct _IdleMessage IdleMessage;
-struct _IdleMessage
-{
-  DBusSpy      *spy;
+/* a new notification when server_id is 0, otherwise the server's reply to one */
+typedef struct {
   Notification *note;
-};
+  guint32 server_id;
+} QueueEntry;
 
 static guint signals[LAST_SIGNAL];
 
 static void dbus_spy_class_init(DBusSpyClass *klass);
 static void dbus_spy_init(DBusSpy *self);
 static void dbus_spy_dispose(GObject *object);
+static void dbus_spy_finalize(GObject *object);
 
-static void add_filter(DBusSpy *self);
+static void add_match(DBusSpy *self);
+static void send_add_match(DBusSpy *self, const gchar *rule);
+static void become_monitor(DBusSpy *self);
 
-static void bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
+static void connection_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
+static void become_monitor_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
 
 static GDBusMessage *message_filter(GDBusConnection *connection, GDBusMessage *message,
                                     gboolean incoming, gpointer user_data);
 
-static gboolean idle_message_emit(gpointer user_data);
+static gboolean handle_message(DBusSpy *self, GDBusMessage *message);
+static void handle_notify(DBusSpy *self, GDBusMessage *message);
+static gboolean handle_return(DBusSpy *self, GDBusMessage *message);
+static void pending_add(DBusSpy *self, GDBusMessage *message, Notification *note);
+static void pending_clear(DBusSpyPendingCall *call);
+static void pending_forget(DBusSpy *self, Notification *note);
+static void queue_push(DBusSpy *self, Notification *note, guint32 server_id);
+static void queue_entry_free(gpointer data);
+static gboolean queue_flush(gpointer user_data);
 
-#define MATCH_STRING "eavesdrop=true,type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+#define MONITOR_MATCH_STRING "type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+#define EAVESDROP_MATCH_STRING "eavesdrop=true," MONITOR_MATCH_STRING
+
+/* the replies carry the ids the server assigned, which later replaces_id values refer to */
+#define MONITOR_RETURN_MATCH_STRING "type='method_return',sender='org.freedesktop.Notifications'"
+#define EAVESDROP_RETURN_MATCH_STRING "eavesdrop=true," MONITOR_RETURN_MATCH_STRING
 
 G_DEFINE_TYPE_WITH_PRIVATE(DBusSpy, dbus_spy, G_TYPE_OBJECT);
 
@@ -40,27 +59,44 @@ dbus_spy_class_init(DBusSpyClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS(klass);
   object_class->dispose = dbus_spy_dispose;
+  object_class->finalize = dbus_spy_finalize;
+
+  signals[MESSAGES_RECEIVED] =
+    g_signal_new(DBUS_SPY_SIGNAL_MESSAGES_RECEIVED,
+                 G_TYPE_FROM_CLASS(klass),
+                 G_SIGNAL_RUN_LAST,
+                 G_STRUCT_OFFSET(DBusSpyClass, messages_received),
+                 NULL, NULL,
+                 g_cclosure_marshal_VOID__BOXED,
+                 G_TYPE_NONE,
+                 1, G_TYPE_PTR_ARRAY | G_SIGNAL_TYPE_STATIC_SCOPE);
 
-  signals[MESSAGE_RECEIVED] =
-    g_signal_new(DBUS_SPY_SIGNAL_MESSAGE_RECEIVED,
+  signals[NOTIFICATION_ACKNOWLEDGED] =
+    g_signal_new(DBUS_SPY_SIGNAL_NOTIFICATION_ACKNOWLEDGED,
                  G_TYPE_FROM_CLASS(klass),
                  G_SIGNAL_RUN_LAST,
-                 G_STRUCT_OFFSET(DBusSpyClass, message_received),
+                 G_STRUCT_OFFSET(DBusSpyClass, notification_acknowledged),
                  NULL, NULL,
-                 g_cclosure_marshal_VOID__OBJECT,
+                 NULL,
                  G_TYPE_NONE,
-                 1, NOTIFICATION_TYPE);
+                 2, NOTIFICATION_TYPE, G_TYPE_UINT);
 }
 
 static void
-bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+connection_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
   GError *error = NULL;
 
-  GDBusConnection *connection = g_bus_get_finish(res, &error);
+  GDBusConnection *connection = g_dbus_connection_new_for_address_finish(res, &error);
+
+  /* the spy was disposed before the connection was up */
+  if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_error_free(error);
+    return;
+  }
 
   if(error != NULL) {
-    g_warning("Could not get a connection to the dbus session bus: %s\n", error->message);
+    g_warning("Could not get a connection to the message bus: %s\n", error->message);
     g_error_free(error);
     return;
   }
@@ -68,18 +104,82 @@ bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
   DBusSpy *self = DBUS_SPY(user_data);
   g_return_if_fail(self != NULL);
 
-  if(self->priv->connection_cancel != NULL) {
-    g_object_unref(self->priv->connection_cancel);
-    self->priv->connection_cancel = NULL;
+  self->priv->connection = connection;
+
+  /* install the filter first so that nothing slips through while the match is set up */
+  self->priv->filter_id = g_dbus_connection_add_filter(self->priv->connection, message_filter, self, NULL);
+
+  if(self->priv->mode == DBUS_SPY_CAPTURE_EAVESDROP) {
+    add_match(self);
+  }
+  else {
+    become_monitor(self);
   }
+}
 
-  self->priv->connection = connection;
+/*
+ * The connection is our own, so once it is a monitor the bus only sends it
+ * what the match rules ask for. Monitors may not send anything afterwards.
+ */
+static void
+become_monitor(DBusSpy *self)
+{
+  const gchar *rules[] = { MONITOR_MATCH_STRING, MONITOR_RETURN_MATCH_STRING, NULL };
+
+  g_dbus_connection_call(self->priv->connection,
+                         "org.freedesktop.DBus",
+                         "/org/freedesktop/DBus",
+                         "org.freedesktop.DBus.Monitoring",
+                         "BecomeMonitor",
+                         g_variant_new("(^asu)", rules, 0),
+                         NULL,
+                         G_DBUS_CALL_FLAGS_NONE,
+                         -1,
+                         self->priv->connection_cancel,
+                         become_monitor_cb,
+                         self);
+}
+
+static void
+become_monitor_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+
+  GVariant *ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source_object), res, &error);
+
+  if(ret != NULL) {
+    g_variant_unref(ret);
+    DBUS_SPY(user_data)->priv->monitoring = TRUE;
+    return;
+  }
 
-  add_filter(self);
+  if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_error_free(error);
+    return;
+  }
+
+  DBusSpy *self = DBUS_SPY(user_data);
+
+  if(self->priv->mode == DBUS_SPY_CAPTURE_MONITOR) {
+    g_warning("Failed to become a bus monitor: %s\n", error->message);
+  }
+  else {
+    g_debug("Bus does not support monitoring (%s), falling back to eavesdropping", error->message);
+    add_match(self);
+  }
+
+  g_error_free(error);
 }
 
 static void
-add_filter(DBusSpy *self)
+add_match(DBusSpy *self)
+{
+  send_add_match(self, EAVESDROP_MATCH_STRING);
+  send_add_match(self, EAVESDROP_RETURN_MATCH_STRING);
+}
+
+static void
+send_add_match(DBusSpy *self, const gchar *rule)
 {
   GDBusMessage *message;
   GVariant *body;
@@ -88,7 +188,7 @@ add_filter(DBusSpy *self)
   message = g_dbus_message_new_method_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
       "org.freedesktop.DBus", "AddMatch");
 
-  body = g_variant_new_parsed("(%s,)", MATCH_STRING);
+  body = g_variant_new_parsed("(%s,)", rule);
 
   g_dbus_message_set_body(message, body);
 
@@ -97,13 +197,13 @@ add_filter(DBusSpy *self)
                                  G_DBUS_SEND_MESSAGE_FLAGS_NONE,
                                  NULL,
                                  &error);
+  g_object_unref(message);
+
   if(error != NULL) {
     g_warning("Failed to send AddMatch message: %s\n", error->message);
     g_error_free(error);
     return;
   }
-
-  g_dbus_connection_add_filter(self->priv->connection, message_filter, self, NULL);
 }
 
 static GDBusMessage*
@@ -111,7 +211,28 @@ message_filter(GDBusConnection *connection, GDBusMessage *message, gboolean inco
 {
   if(!incoming) return message;
 
+  g_atomic_int_inc(&DBUS_SPY(user_data)->priv->messages_seen);
+
+  if(handle_message(DBUS_SPY(user_data), message)) {
+    g_object_unref(message);
+    message = NULL;
+  }
+
+  return message;
+}
+
+/*
+ * Returns TRUE if the message was one of ours. Replies to our own calls, such
+ * as BecomeMonitor, never match a pending Notify and are left alone.
+ */
+static gboolean
+handle_message(DBusSpy *self, GDBusMessage *message)
+{
   GDBusMessageType type = g_dbus_message_get_message_type(message);
+
+  if(type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    return handle_return(self, message);
+
   const gchar *interface = g_dbus_message_get_interface(message);
   const gchar *member = g_dbus_message_get_member(message);
 
@@ -119,31 +240,350 @@ message_filter(GDBusConnection *connection, GDBusMessage *message, gboolean inco
       && (g_strcmp0(interface, "org.freedesktop.Notifications") == 0)
       && (g_strcmp0(member, "Notify") == 0))
   {
-    DBusSpy *spy = DBUS_SPY(user_data);
-    Notification *note = notification_new_from_dbus_message(message);
-    IdleMessage *im = g_new0(IdleMessage, 1);
-    im->spy = spy;
-    im->note = note;
-    g_idle_add(idle_message_emit, im);
-    g_object_unref(message);
-    message = NULL;
+    handle_notify(self, message);
+    return TRUE;
   }
 
-  return message;
+  return FALSE;
 }
 
+/*
+ * Swaps a pointer without a lock. g_atomic_pointer_exchange() is too new for
+ * the GLib we depend on.
+ */
+static gpointer
+atomic_pointer_exchange(gpointer *location, gpointer value)
+{
+  gpointer old;
+
+  do {
+    old = g_atomic_pointer_get(location);
+  } while(!g_atomic_pointer_compare_and_exchange(location, old, value));
+
+  return old;
+}
+
+/*
+ * Called from the GDBus worker thread. Picks up the newest filter snapshot
+ * and drops unwanted messages before any Notification gets built.
+ */
+static void
+handle_notify(DBusSpy *self, GDBusMessage *message)
+{
+  RuleSet *rules = atomic_pointer_exchange(&self->priv->rules_next, NULL);
+
+  /* the worker owns the current rules, so it can retire the old ones itself */
+  if(rules != NULL) {
+    if(self->priv->rules != NULL)
+      rule_set_unref(self->priv->rules);
+    self->priv->rules = rules;
+  }
+
+  gint64 start = stats_stage_begin();
+  NotificationVerdict verdict = notification_prefilter(message, self->priv->rules);
+  stats_stage_end(STATS_STAGE_FILTER, start);
+
+  g_atomic_int_inc(&self->priv->notifies_seen);
+  stats_count(STATS_COUNTER_RECEIVED);
+
+  switch(verdict) {
+    case NOTIFICATION_VERDICT_ACCEPT:
+      break;
+    case NOTIFICATION_VERDICT_PRIVATE:
+      stats_count(STATS_COUNTER_PRIVATE);
+      return;
+    case NOTIFICATION_VERDICT_EMPTY:
+      stats_count(STATS_COUNTER_EMPTY);
+      return;
+    case NOTIFICATION_VERDICT_FILTERED:
+      stats_count(STATS_COUNTER_FILTERED);
+      return;
+    default:
+      stats_count(STATS_COUNTER_MALFORMED);
+      return;
+  }
+
+  start = stats_stage_begin();
+  Notification *note = notification_new_from_dbus_message(message);
+  stats_stage_end(STATS_STAGE_PARSE, start);
+
+  if(note == NULL) {
+    stats_count(STATS_COUNTER_MALFORMED);
+    return;
+  }
+
+  pending_add(self, message, note);
+  queue_push(self, note, 0);
+}
+
+/*
+ * Called from the GDBus worker thread. Remembers an accepted call until the
+ * server replies to it. The oldest call is forgotten when too many are
+ * waiting, so a server that never replies costs a fixed amount of memory.
+ */
+static void
+pending_add(DBusSpy *self, GDBusMessage *message, Notification *note)
+{
+  const gchar *sender = g_dbus_message_get_sender(message);
+
+  if(sender == NULL || (g_dbus_message_get_flags(message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED))
+    return;
+
+  DBusSpyPendingCall *call = &self->priv->pending[self->priv->pending_next];
+  pending_clear(call);
+
+  call->sender = g_strdup(sender);
+  call->serial = g_dbus_message_get_serial(message);
+  call->note = g_object_ref(note);
+
+  self->priv->pending_next = (self->priv->pending_next + 1) % DBUS_SPY_PENDING_MAX;
+}
+
+static void
+pending_clear(DBusSpyPendingCall *call)
+{
+  g_clear_object(&call->note);
+  g_free(call->sender);
+  call->sender = NULL;
+  call->serial = 0;
+}
+
+/*
+ * Called from the GDBus worker thread. Forgets the call of a notification
+ * that was dropped, a reply to it would only keep it alive in the queue.
+ */
+static void
+pending_forget(DBusSpy *self, Notification *note)
+{
+  guint i;
+
+  for(i = 0; i < DBUS_SPY_PENDING_MAX; i++) {
+    if(self->priv->pending[i].note == note)
+      pending_clear(&self->priv->pending[i]);
+  }
+}
+
+/*
+ * Called from the GDBus worker thread. Matches a reply from the
+ * notification server to the call it answers and queues the id it assigned.
+ */
 static gboolean
-idle_message_emit(gpointer user_data)
+handle_return(DBusSpy *self, GDBusMessage *message)
 {
-  IdleMessage *message = (IdleMessage *)user_data;
+  const gchar *destination = g_dbus_message_get_destination(message);
+  guint32 serial = g_dbus_message_get_reply_serial(message);
+  GVariant *body = g_dbus_message_get_body(message);
+  guint i;
+
+  if(destination == NULL || body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE("(u)")))
+    return FALSE;
 
-  g_signal_emit(message->spy, signals[MESSAGE_RECEIVED], 0, message->note);
+  for(i = 0; i < DBUS_SPY_PENDING_MAX; i++) {
+    DBusSpyPendingCall *call = &self->priv->pending[i];
 
-  g_free(message);
+    if(call->note != NULL && call->serial == serial && g_strcmp0(call->sender, destination) == 0) {
+      guint32 server_id;
+
+      g_variant_get(body, "(u)", &server_id);
+
+      if(server_id != 0)
+        queue_push(self, g_object_ref(call->note), server_id);
+
+      pending_clear(call);
+      return TRUE;
+    }
+  }
 
   return FALSE;
 }
 
+/*
+ * Removes the oldest queued notification, or the oldest with the given
+ * urgency unless that is -1, along with a queued reply to it and its pending
+ * call. The caller holds the queue lock, runs on the worker thread and knows
+ * there is one.
+ */
+static void
+queue_drop(DBusSpy *self, gint urgency)
+{
+  GList *link;
+
+  for(link = self->priv->queue.head; link != NULL; link = link->next) {
+    QueueEntry *entry = link->data;
+
+    /* replies go with their notification */
+    if(entry->server_id != 0)
+      continue;
+
+    NotificationUrgency found = notification_get_urgency(entry->note);
+
+    if(urgency < 0 || (gint) found == urgency) {
+      GList *reply;
+
+      /* a reply always comes after the notification it answers */
+      for(reply = link->next; reply != NULL; reply = reply->next) {
+        QueueEntry *other = reply->data;
+
+        if(other->server_id != 0 && other->note == entry->note) {
+          g_queue_delete_link(&self->priv->queue, reply);
+          queue_entry_free(other);
+          break;
+        }
+      }
+
+      pending_forget(self, entry->note);
+      g_queue_delete_link(&self->priv->queue, link);
+      queue_entry_free(entry);
+      self->priv->queued[found]--;
+      self->priv->dropped++;
+      stats_count(STATS_COUNTER_DROPPED);
+      return;
+    }
+  }
+}
+
+/*
+ * Makes room for a new notification in a full queue, the caller holds the
+ * lock. Returns FALSE if the new notification is the one to give up.
+ */
+static gboolean
+queue_make_room(DBusSpy *self, Notification *note)
+{
+  guint *queued = self->priv->queued;
+  gint lowest;
+
+  switch(self->priv->policy) {
+    case DBUS_SPY_DROP_NEWEST:
+      self->priv->dropped++;
+      stats_count(STATS_COUNTER_DROPPED);
+      return FALSE;
+
+    case DBUS_SPY_DROP_LOWEST_URGENCY:
+      for(lowest = NOTIFICATION_URGENCY_LOW; queued[lowest] == 0; lowest++);
+
+      /* among equals the older one goes, it is the more likely to be stale */
+      if(lowest > (gint) notification_get_urgency(note)) {
+        self->priv->dropped++;
+        stats_count(STATS_COUNTER_DROPPED);
+        return FALSE;
+      }
+      queue_drop(self, lowest);
+      return TRUE;
+
+    case DBUS_SPY_DROP_OLDEST:
+    default:
+      queue_drop(self, -1);
+      return TRUE;
+  }
+}
+
+/*
+ * Called from the GDBus worker thread. Only the first message of a burst
+ * schedules a flush, later ones just join the pending batch. At most
+ * queue_limit notifications wait at once, the overload policy decides which
+ * ones are dropped. A reply is only queued for a notification that is still
+ * queued or among the DBUS_SPY_PENDING_MAX last ones delivered, so the queue
+ * keeps no more than that many notifications alive beyond the limit.
+ */
+static void
+queue_push(DBusSpy *self, Notification *note, guint32 server_id)
+{
+  QueueEntry *entry = g_slice_new(QueueEntry);
+  guint *queued = self->priv->queued;
+
+  entry->note = note;
+  entry->server_id = server_id;
+
+  g_mutex_lock(&self->priv->queue_lock);
+
+  /* the spy is going away and must not be kept alive by a new flush */
+  if(self->priv->closed) {
+    g_mutex_unlock(&self->priv->queue_lock);
+    queue_entry_free(entry);
+    return;
+  }
+
+  if(server_id == 0) {
+    if(queued[0] + queued[1] + queued[2] >= self->priv->queue_limit && !queue_make_room(self, note)) {
+      pending_forget(self, note);
+      g_mutex_unlock(&self->priv->queue_lock);
+      queue_entry_free(entry);
+      return;
+    }
+
+    queued[notification_get_urgency(note)]++;
+    self->priv->high_water = MAX(self->priv->high_water, queued[0] + queued[1] + queued[2]);
+  }
+
+  g_queue_push_tail(&self->priv->queue, entry);
+
+  /* under the lock, so dispose cannot start between the check and the ref */
+  if(!self->priv->flush_scheduled) {
+    GSource *source = g_idle_source_new();
+
+    self->priv->flush_scheduled = TRUE;
+    g_source_set_callback(source, queue_flush, g_object_ref(self), g_object_unref);
+    g_source_attach(source, self->priv->context);
+    g_source_unref(source);
+  }
+
+  g_mutex_unlock(&self->priv->queue_lock);
+}
+
+static void
+queue_entry_free(gpointer data)
+{
+  QueueEntry *entry = data;
+
+  g_object_unref(entry->note);
+  g_slice_free(QueueEntry, entry);
+}
+
+/*
+ * Delivers new notifications in batches. A reply ends the current batch, so
+ * listeners always see a notification before the id the server gave it.
+ */
+static gboolean
+queue_flush(gpointer user_data)
+{
+  DBusSpy *self = DBUS_SPY(user_data);
+  GQueue entries;
+  GPtrArray *batch;
+  QueueEntry *entry;
+
+  g_mutex_lock(&self->priv->queue_lock);
+  entries = self->priv->queue;
+  g_queue_init(&self->priv->queue);
+  memset(self->priv->queued, 0, sizeof(self->priv->queued));
+  self->priv->flush_scheduled = FALSE;
+  g_mutex_unlock(&self->priv->queue_lock);
+
+  batch = g_ptr_array_new_full(entries.length, g_object_unref);
+
+  while((entry = g_queue_pop_head(&entries)) != NULL) {
+    if(entry->server_id == 0) {
+      g_ptr_array_add(batch, g_object_ref(entry->note));
+    }
+    else {
+      if(batch->len > 0) {
+        g_signal_emit(self, signals[MESSAGES_RECEIVED], 0, batch);
+        g_ptr_array_set_size(batch, 0);
+      }
+      g_signal_emit(self, signals[NOTIFICATION_ACKNOWLEDGED], 0, entry->note, entry->server_id);
+    }
+
+    queue_entry_free(entry);
+  }
+
+  if(batch->len > 0) {
+    g_signal_emit(self, signals[MESSAGES_RECEIVED], 0, batch);
+  }
+
+  g_ptr_array_unref(batch);
+
+  return G_SOURCE_REMOVE;
+}
+
 static void
 dbus_spy_init(DBusSpy *self)
 {
@@ -151,11 +591,25 @@ dbus_spy_init(DBusSpy *self)
 
   self->priv->connection = NULL;
   self->priv->connection_cancel = g_cancellable_new();
-
-  g_bus_get(G_BUS_TYPE_SESSION,
-            self->priv->connection_cancel,
-            bus_get_cb,
-            self);
+  self->priv->context = g_main_context_ref_thread_default();
+  g_mutex_init(&self->priv->queue_lock);
+  g_queue_init(&self->priv->queue);
+  self->priv->flush_scheduled = FALSE;
+  self->priv->queue_limit = DBUS_SPY_QUEUE_LIMIT;
+  self->priv->policy = DBUS_SPY_DROP_OLDEST;
+  memset(self->priv->queued, 0, sizeof(self->priv->queued));
+  self->priv->high_water = 0;
+  self->priv->dropped = 0;
+  self->priv->closed = FALSE;
+  self->priv->filter_id = 0;
+  self->priv->rules = NULL;
+  self->priv->rules_next = NULL;
+  memset(self->priv->pending, 0, sizeof(self->priv->pending));
+  self->priv->pending_next = 0;
+  self->priv->mode = DBUS_SPY_CAPTURE_AUTO;
+  self->priv->monitoring = FALSE;
+  self->priv->messages_seen = 0;
+  self->priv->notifies_seen = 0;
 }
 
 static void
@@ -163,24 +617,240 @@ dbus_spy_dispose(GObject *object)
 {
   DBusSpy *self = DBUS_SPY(object);
 
+  g_mutex_lock(&self->priv->queue_lock);
+  self->priv->closed = TRUE;
+  g_queue_free_full(&self->priv->queue, queue_entry_free);
+  g_queue_init(&self->priv->queue);
+  memset(self->priv->queued, 0, sizeof(self->priv->queued));
+  g_mutex_unlock(&self->priv->queue_lock);
+
   if(self->priv->connection_cancel != NULL) {
     g_cancellable_cancel(self->priv->connection_cancel);
     g_object_unref(self->priv->connection_cancel);
     self->priv->connection_cancel = NULL;
   }
 
+  /*
+   * The filter runs on the GDBus worker thread, and neither removing it nor
+   * an asynchronous close waits for a call that is already running. Closing
+   * synchronously does, since the worker handles the close after it.
+   */
   if(self->priv->connection != NULL) {
-    g_dbus_connection_close(self->priv->connection, NULL, NULL, NULL);
+    g_dbus_connection_close_sync(self->priv->connection, NULL, NULL);
+    if(self->priv->filter_id != 0) {
+      g_dbus_connection_remove_filter(self->priv->connection, self->priv->filter_id);
+      self->priv->filter_id = 0;
+    }
     g_object_unref(self->priv->connection);
     self->priv->connection = NULL;
   }
 
+  if(self->priv->context != NULL) {
+    g_main_context_unref(self->priv->context);
+    self->priv->context = NULL;
+  }
+
   G_OBJECT_CLASS(dbus_spy_parent_class)->dispose(object);
 }
 
+static void
+dbus_spy_finalize(GObject *object)
+{
+  DBusSpy *self = DBUS_SPY(object);
+  guint i;
+
+  /* only the worker touched these, and it is done with the closed connection */
+  for(i = 0; i < DBUS_SPY_PENDING_MAX; i++)
+    pending_clear(&self->priv->pending[i]);
+
+  if(self->priv->rules != NULL)
+    rule_set_unref(self->priv->rules);
+
+  if(self->priv->rules_next != NULL)
+    rule_set_unref(self->priv->rules_next);
+
+  g_mutex_clear(&self->priv->queue_lock);
+
+  G_OBJECT_CLASS(dbus_spy_parent_class)->finalize(object);
+}
+
 DBusSpy*
 dbus_spy_new(void)
 {
-  return DBUS_SPY(g_object_new(DBUS_SPY_TYPE, NULL));
+  return dbus_spy_new_with_mode(DBUS_SPY_CAPTURE_AUTO);
+}
+
+/**
+ * dbus_spy_new_with_mode:
+ * @mode: how to capture Notify calls
+ *
+ * Creates a spy on a private connection to the session bus. In
+ * DBUS_SPY_CAPTURE_AUTO mode it becomes a bus monitor and falls back to an
+ * eavesdropping match rule on buses that do not support monitoring.
+ **/
+DBusSpy*
+dbus_spy_new_with_mode(DBusSpyCaptureMode mode)
+{
+  GError *error = NULL;
+  gchar *address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+
+  if(address == NULL) {
+    DBusSpy *self = DBUS_SPY(g_object_new(DBUS_SPY_TYPE, NULL));
+
+    g_warning("Could not find the dbus session bus: %s\n", error->message);
+    g_error_free(error);
+    self->priv->mode = mode;
+    return self;
+  }
+
+  DBusSpy *self = dbus_spy_new_for_address(address, mode);
+  g_free(address);
+
+  return self;
+}
+
+/**
+ * dbus_spy_new_for_address:
+ * @address: the address of a message bus
+ * @mode: how to capture Notify calls
+ *
+ * Creates a spy on a private connection to the bus at @address, like
+ * dbus_spy_new_with_mode() does for the session bus. All connections share
+ * the one GDBus worker thread, each spy only adds its own filter.
+ **/
+DBusSpy*
+dbus_spy_new_for_address(const gchar *address, DBusSpyCaptureMode mode)
+{
+  DBusSpy *self = DBUS_SPY(g_object_new(DBUS_SPY_TYPE, NULL));
+
+  g_return_val_if_fail(address != NULL, self);
+
+  self->priv->mode = mode;
+
+  g_dbus_connection_new_for_address(address,
+                                    G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                    G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                    NULL,
+                                    self->priv->connection_cancel,
+                                    connection_cb,
+                                    self);
+
+  return self;
 }
 
+/**
+ * dbus_spy_is_monitoring:
+ * @self: the spy
+ *
+ * Returns TRUE once the spy's connection has become a bus monitor.
+ **/
+gboolean
+dbus_spy_is_monitoring(DBusSpy *self)
+{
+  g_return_val_if_fail(IS_DBUS_SPY(self), FALSE);
+
+  return self->priv->monitoring;
+}
+
+/**
+ * dbus_spy_get_messages_seen:
+ * @self: the spy
+ * @notifies: (out) (optional): the number of Notify calls among them
+ *
+ * Returns the number of incoming messages that went through the filter, to
+ * compare how much the capture modes wake us up.
+ **/
+guint
+dbus_spy_get_messages_seen(DBusSpy *self, guint *notifies)
+{
+  g_return_val_if_fail(IS_DBUS_SPY(self), 0);
+
+  if(notifies != NULL)
+    *notifies = (guint) g_atomic_int_get(&self->priv->notifies_seen);
+
+  return (guint) g_atomic_int_get(&self->priv->messages_seen);
+}
+
+
+/**
+ * dbus_spy_inject_message:
+ * @self: the spy
+ * @message: a captured org.freedesktop.Notifications.Notify call, or the
+ *   server's reply to one
+ *
+ * Handles @message as if it had been seen on the bus. The resulting batch is
+ * delivered from the spy's main context like any other. Only meant for spies
+ * without a live connection, as it runs the worker thread's code path.
+ **/
+void
+dbus_spy_inject_message(DBusSpy *self, GDBusMessage *message)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+  g_return_if_fail(G_IS_DBUS_MESSAGE(message));
+
+  handle_message(self, message);
+}
+
+/**
+ * dbus_spy_set_rules:
+ * @self: the spy
+ * @rules: the rules whose matching notifications are discarded
+ *
+ * Publishes new filter rules to the worker thread. The spy takes a
+ * reference to @rules.
+ **/
+void
+dbus_spy_set_rules(DBusSpy *self, RuleSet *rules)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+  g_return_if_fail(rules != NULL);
+
+  RuleSet *old = atomic_pointer_exchange(&self->priv->rules_next, rule_set_ref(rules));
+
+  /* the worker never saw these */
+  if(old != NULL)
+    rule_set_unref(old);
+}
+
+/**
+ * dbus_spy_set_queue_limit:
+ * @self: the spy
+ * @limit: how many notifications may wait for the main context, at least 1
+ * @policy: which notification to drop when one more arrives
+ *
+ * Bounds the notifications that pile up while the main context is busy. A
+ * lower limit only takes effect as the queue drains.
+ **/
+void
+dbus_spy_set_queue_limit(DBusSpy *self, guint limit, DBusSpyOverloadPolicy policy)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+
+  g_mutex_lock(&self->priv->queue_lock);
+  self->priv->queue_limit = MAX(limit, 1);
+  self->priv->policy = policy;
+  g_mutex_unlock(&self->priv->queue_lock);
+}
+
+/**
+ * dbus_spy_get_queue_stats:
+ * @self: the spy
+ * @high_water: (out) (optional): the most notifications that ever waited at once
+ *
+ * Returns how many notifications were dropped because the queue was full.
+ **/
+guint
+dbus_spy_get_queue_stats(DBusSpy *self, guint *high_water)
+{
+  guint dropped;
+
+  g_return_val_if_fail(IS_DBUS_SPY(self), 0);
+
+  g_mutex_lock(&self->priv->queue_lock);
+  dropped = self->priv->dropped;
+  if(high_water != NULL)
+    *high_water = self->priv->high_water;
+  g_mutex_unlock(&self->priv->queue_lock);
+
+  return dropped;
+}
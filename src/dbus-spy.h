@@ -19,6 +19,25 @@ G_BEGIN_DECLS
 #define IS_DBUS_SPY(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), DBUS_SPY_TYPE))
 #define IS_DBUS_SPY_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), DBUS_SPY_TYPE))
 
+typedef enum {
+  DBUS_SPY_CAPTURE_AUTO,
+  DBUS_SPY_CAPTURE_MONITOR,
+  DBUS_SPY_CAPTURE_EAVESDROP
+} DBusSpyCaptureMode;
+
+/* what to give up when more notifications arrive than the queue may hold */
+typedef enum {
+  DBUS_SPY_DROP_OLDEST,
+  DBUS_SPY_DROP_NEWEST,
+  DBUS_SPY_DROP_LOWEST_URGENCY
+} DBusSpyOverloadPolicy;
+
+/* how many Notify calls may wait for their method return at once */
+#define DBUS_SPY_PENDING_MAX 64
+
+/* how many notifications may wait for the main context by default */
+#define DBUS_SPY_QUEUE_LIMIT 1024
+
 typedef struct _DBusSpy       DBusSpy;
 typedef struct _DBusSpyClass  DBusSpyClass;
 typedef struct _DBusSpyPrivate DBusSpyPrivate;
@@ -33,19 +52,66 @@ struct _DBusSpyClass
 {
   GObjectClass parent_class;
 
-  void (* message_received) (DBusSpy *spy,
-                             Notification *note);
+  void (* messages_received) (DBusSpy *spy,
+                              GPtrArray *notes);
+  void (* notification_acknowledged) (DBusSpy *spy,
+                                      Notification *note,
+                                      guint server_id);
 };
 
+typedef struct {
+  gchar *sender;
+  guint32 serial;
+  Notification *note;
+} DBusSpyPendingCall;
+
 struct _DBusSpyPrivate {
   GDBusConnection *connection;
   GCancellable *connection_cancel;
+  GMainContext *context;
+  guint filter_id;
+  DBusSpyCaptureMode mode;
+  gboolean monitoring;
+
+  /* counters, bumped by the worker thread */
+  gint messages_seen;
+  gint notifies_seen;
+
+  /* filter rules owned by the worker thread, and the next ones published for it */
+  RuleSet *rules;
+  gpointer rules_next;
+
+  /* accepted Notify calls waiting for the server's reply, owned by the worker thread */
+  DBusSpyPendingCall pending[DBUS_SPY_PENDING_MAX];
+  guint pending_next;
+
+  /* notifications waiting for the main context, filled by the GDBus worker thread */
+  GMutex queue_lock;
+  GQueue queue;
+  gboolean flush_scheduled;
+  /* set by dispose, nothing is queued or scheduled afterwards */
+  gboolean closed;
+  guint queue_limit;
+  DBusSpyOverloadPolicy policy;
+  /* notifications in the queue by urgency, replies are not counted but leave with them */
+  guint queued[3];
+  guint high_water;
+  guint dropped;
 };
 
-#define DBUS_SPY_SIGNAL_MESSAGE_RECEIVED "message-received"
+#define DBUS_SPY_SIGNAL_MESSAGES_RECEIVED "messages-received"
+#define DBUS_SPY_SIGNAL_NOTIFICATION_ACKNOWLEDGED "notification-acknowledged"
 
 GType    dbus_spy_get_type(void);
 DBusSpy* dbus_spy_new(void);
+DBusSpy* dbus_spy_new_with_mode(DBusSpyCaptureMode mode);
+DBusSpy* dbus_spy_new_for_address(const gchar *address, DBusSpyCaptureMode mode);
+gboolean dbus_spy_is_monitoring(DBusSpy *self);
+guint    dbus_spy_get_messages_seen(DBusSpy *self, guint *notifies);
+void     dbus_spy_inject_message(DBusSpy *self, GDBusMessage *message);
+void     dbus_spy_set_rules(DBusSpy *self, RuleSet *rules);
+void     dbus_spy_set_queue_limit(DBusSpy *self, guint limit, DBusSpyOverloadPolicy policy);
+guint    dbus_spy_get_queue_stats(DBusSpy *self, guint *high_water);
 
 G_END_DECLS
 
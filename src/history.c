@@ -0,0 +1,591 @@
+/*
+ * history.c - An append-only log of notifications that survives restarts.
+ *
+ * Every change is one record appended to the log: a notification was added,
+ * replaced or removed. Each record ends with its own length, so the newest
+ * records can be read by walking a memory-mapped log backwards and stopping
+ * as soon as enough notifications have been found. Loading therefore costs
+ * the same however long the log has grown, and compaction rewrites it with
+ * just the notifications still worth keeping.
+ *
+ * Records are collected in memory and written together a moment after the
+ * first of them, so a burst of notifications costs one write instead of one
+ * per notification. Compaction runs in a worker thread on the log as it was
+ * when it started. Records appended meanwhile wait in memory and go to the
+ * new log once it is in place, so a slow disk never stalls the main loop.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "history.h"
+
+/* "AN", for Ayatana Notifications */
+#define HISTORY_MAGIC 0x4e41
+
+enum {
+  RECORD_ADD = 1,
+  RECORD_UPDATE,
+  RECORD_REMOVE
+};
+
+/* all integers are little-endian, the strings follow the header */
+typedef struct {
+  guint16 magic;
+  guint8  type;
+  guint8  reserved;
+  guint32 app_name_length;
+  guint32 summary_length;
+  guint32 body_length;
+  guint64 id;
+  gint64  timestamp;
+} RecordHeader;
+
+#define TRAILER_SIZE    sizeof(guint32)
+#define MIN_RECORD_SIZE (sizeof(RecordHeader) + TRAILER_SIZE)
+
+/* seconds records may wait before they are written */
+#define FLUSH_DELAY 2
+
+struct _History
+{
+  gchar   *path;
+  guint    keep;
+  gint     fd;
+  /* records appended since the log was last compacted */
+  guint    appended;
+  /* records not written yet, and the source that writes them */
+  GString *pending;
+  guint    flush_id;
+  /* a compaction is running, and what happened to the history meanwhile */
+  gboolean compacting;
+  guint    appended_before;
+  gboolean cleared;
+  gboolean freed;
+};
+
+/* what a compaction thread works on, copied so it never touches the History */
+typedef struct {
+  gchar *path;
+  guint  keep;
+} Compaction;
+
+static gboolean
+write_all(gint fd, const gchar *data, gsize length)
+{
+  while(length > 0) {
+    gssize written = write(fd, data, length);
+
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      return FALSE;
+    }
+
+    data += written;
+    length -= written;
+  }
+
+  return TRUE;
+}
+
+static void
+append_record(GString *buffer, guint8 type, const HistoryEntry *entry)
+{
+  RecordHeader header;
+  guint32 length = MIN_RECORD_SIZE + entry->app_name_length + entry->summary_length + entry->body_length;
+  guint32 trailer = GUINT32_TO_LE(length);
+
+  header.magic = GUINT16_TO_LE(HISTORY_MAGIC);
+  header.type = type;
+  header.reserved = 0;
+  header.app_name_length = GUINT32_TO_LE(entry->app_name_length);
+  header.summary_length = GUINT32_TO_LE(entry->summary_length);
+  header.body_length = GUINT32_TO_LE(entry->body_length);
+  header.id = GUINT64_TO_LE(entry->id);
+  header.timestamp = GINT64_TO_LE(entry->timestamp);
+
+  g_string_append_len(buffer, (const gchar *) &header, sizeof header);
+
+  /* removals carry no strings */
+  if(type != RECORD_REMOVE) {
+    g_string_append_len(buffer, entry->app_name, entry->app_name_length);
+    g_string_append_len(buffer, entry->summary, entry->summary_length);
+    g_string_append_len(buffer, entry->body, entry->body_length);
+  }
+
+  g_string_append_len(buffer, (const gchar *) &trailer, sizeof trailer);
+}
+
+/* one write per batch, so a crash can only ever tear the end of the log */
+static void
+write_pending(History *history)
+{
+  if(history->flush_id != 0) {
+    g_source_remove(history->flush_id);
+    history->flush_id = 0;
+  }
+
+  /* the log is about to be replaced, the records go to the new one */
+  if(history->pending->len == 0 || history->compacting)
+    return;
+
+  if(history->fd >= 0 && !write_all(history->fd, history->pending->str, history->pending->len))
+    g_warning("Could not write the notification history: %s", g_strerror(errno));
+
+  g_string_truncate(history->pending, 0);
+}
+
+static gint
+open_log(const gchar *path)
+{
+  gint fd = g_open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+  if(fd < 0)
+    g_warning("Could not open the notification history %s: %s", path, g_strerror(errno));
+
+  return fd;
+}
+
+/*
+ * Walks the log from its end and collects up to @keep live notifications,
+ * newest first. Replacements found on the way are applied to the
+ * notifications they replace, removed ones are skipped. Returns TRUE if the
+ * log holds anything besides the collected notifications.
+ */
+static gboolean
+scan(const gchar *data, gsize size, guint keep, GArray *entries)
+{
+  GHashTable *removed = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+  GHashTable *updates = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+  gsize pos = size;
+  guint visited = 0;
+
+  while(entries->len < keep && pos >= MIN_RECORD_SIZE) {
+    RecordHeader header;
+    HistoryEntry entry;
+    guint32 length;
+
+    memcpy(&length, data + pos - TRAILER_SIZE, sizeof length);
+    length = GUINT32_FROM_LE(length);
+
+    if(length < MIN_RECORD_SIZE || length > pos)
+      break;
+
+    const gchar *record = data + pos - length;
+    memcpy(&header, record, sizeof header);
+
+    entry.app_name_length = GUINT32_FROM_LE(header.app_name_length);
+    entry.summary_length = GUINT32_FROM_LE(header.summary_length);
+    entry.body_length = GUINT32_FROM_LE(header.body_length);
+
+    /* a torn or foreign record, everything before it is unreachable */
+    if(GUINT16_FROM_LE(header.magic) != HISTORY_MAGIC
+        || (guint64) MIN_RECORD_SIZE + entry.app_name_length + entry.summary_length + entry.body_length != length)
+      break;
+
+    entry.id = GUINT64_FROM_LE(header.id);
+    entry.timestamp = GINT64_FROM_LE(header.timestamp);
+    entry.app_name = record + sizeof header;
+    entry.summary = entry.app_name + entry.app_name_length;
+    entry.body = entry.summary + entry.summary_length;
+
+    pos -= length;
+    visited++;
+
+    if(g_hash_table_contains(removed, &entry.id))
+      continue;
+
+    switch(header.type) {
+      case RECORD_REMOVE: {
+        guint64 *id = g_new(guint64, 1);
+        *id = entry.id;
+        g_hash_table_add(removed, id);
+        break;
+      }
+
+      case RECORD_UPDATE:
+        /* only the newest replacement counts */
+        if(!g_hash_table_contains(updates, &entry.id)) {
+          HistoryEntry *update = g_new(HistoryEntry, 1);
+          *update = entry;
+          g_hash_table_insert(updates, &update->id, update);
+        }
+        break;
+
+      case RECORD_ADD: {
+        /* a replaced notification keeps its place */
+        HistoryEntry *update = g_hash_table_lookup(updates, &entry.id);
+        g_array_append_vals(entries, update != NULL ? update : &entry, 1);
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  g_hash_table_destroy(removed);
+  g_hash_table_destroy(updates);
+
+  return pos != 0 || visited != entries->len;
+}
+
+/*
+ * Writes @entries, given newest first, to a new file and renames it over the
+ * log, so a crash leaves either the old log or the new one.
+ */
+static gboolean
+rewrite(const gchar *path, GArray *entries)
+{
+  gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+  gint fd = g_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  GString *buffer = g_string_new(NULL);
+  gboolean ok = fd >= 0;
+  guint i;
+
+  for(i = entries->len; i > 0; i--)
+    append_record(buffer, RECORD_ADD, &g_array_index(entries, HistoryEntry, i - 1));
+
+  ok = ok && write_all(fd, buffer->str, buffer->len);
+  g_string_free(buffer, TRUE);
+
+  if(fd >= 0) {
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+  }
+
+  ok = ok && g_rename(tmp_path, path) == 0;
+
+  if(!ok) {
+    g_warning("Could not compact the notification history %s: %s", path, g_strerror(errno));
+    g_unlink(tmp_path);
+  }
+
+  g_free(tmp_path);
+
+  return ok;
+}
+
+/* appends go to the rewritten log from now on */
+static void
+reopen(History *history)
+{
+  if(history->fd >= 0)
+    close(history->fd);
+
+  history->fd = open_log(history->path);
+  history->appended = 0;
+}
+
+static GMappedFile*
+map_log(const gchar *path)
+{
+  GError *error = NULL;
+  GMappedFile *file = g_mapped_file_new(path, FALSE, &error);
+
+  if(file == NULL) {
+    if(!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+      g_warning("Could not read the notification history: %s", error->message);
+    g_error_free(error);
+  }
+
+  return file;
+}
+
+/**
+ * history_new:
+ * @path: the log file, created with its directory if missing
+ * @keep: how many notifications are worth keeping
+ *
+ * Opens the log for appending. Errors are reported once and turn the
+ * history into a no-op, notifications still work without it.
+ **/
+History*
+history_new(const gchar *path, guint keep)
+{
+  History *history = g_new0(History, 1);
+  gchar *dir = g_path_get_dirname(path);
+
+  history->path = g_strdup(path);
+  history->keep = MAX(keep, 1);
+  history->pending = g_string_new(NULL);
+
+  if(g_mkdir_with_parents(dir, 0700) != 0)
+    g_warning("Could not create %s: %s", dir, g_strerror(errno));
+
+  history->fd = open_log(path);
+  g_free(dir);
+
+  return history;
+}
+
+/**
+ * history_free:
+ * @history: the history
+ *
+ * Writes the records still waiting and closes the log.
+ **/
+void
+history_free(History *history)
+{
+  /* the compaction finishes the job once it is done */
+  if(history->compacting) {
+    history->freed = TRUE;
+    return;
+  }
+
+  write_pending(history);
+  g_string_free(history->pending, TRUE);
+
+  if(history->fd >= 0)
+    close(history->fd);
+
+  g_free(history->path);
+  g_free(history);
+}
+
+/**
+ * history_set_keep:
+ * @history: the history
+ * @keep: how many notifications are worth keeping from now on
+ *
+ * The next compaction and load keep this many notifications.
+ **/
+void
+history_set_keep(History *history, guint keep)
+{
+  history->keep = MAX(keep, 1);
+}
+
+/**
+ * history_load:
+ * @history: the history
+ * @func: called for each notification, oldest first
+ * @user_data: passed to @func
+ *
+ * Reads back the newest notifications worth keeping. The strings passed to
+ * @func are only valid during the call. The log is compacted afterwards if
+ * it holds anything else. Returns the number of notifications read.
+ **/
+guint
+history_load(History *history, HistoryEntryFunc func, gpointer user_data)
+{
+  GMappedFile *file;
+  GArray *entries;
+  guint n;
+  guint i;
+
+  write_pending(history);
+  file = map_log(history->path);
+
+  if(file == NULL)
+    return 0;
+
+  entries = g_array_sized_new(FALSE, FALSE, sizeof(HistoryEntry), history->keep);
+
+  gboolean stale = scan(g_mapped_file_get_contents(file), g_mapped_file_get_length(file), history->keep, entries);
+
+  for(i = entries->len; i > 0; i--)
+    func(&g_array_index(entries, HistoryEntry, i - 1), user_data);
+
+  if(stale && rewrite(history->path, entries))
+    reopen(history);
+
+  n = entries->len;
+  g_array_unref(entries);
+  g_mapped_file_unref(file);
+
+  return n;
+}
+
+/* returns TRUE if the log was rewritten */
+static gboolean
+compact_file(const gchar *path, guint keep)
+{
+  GMappedFile *file = map_log(path);
+  GArray *entries;
+  gboolean ok;
+
+  if(file == NULL)
+    return FALSE;
+
+  entries = g_array_sized_new(FALSE, FALSE, sizeof(HistoryEntry), keep);
+  scan(g_mapped_file_get_contents(file), g_mapped_file_get_length(file), keep, entries);
+  ok = rewrite(path, entries);
+
+  g_array_unref(entries);
+  g_mapped_file_unref(file);
+
+  return ok;
+}
+
+static void
+compaction_free(gpointer data)
+{
+  Compaction *compaction = data;
+
+  g_free(compaction->path);
+  g_slice_free(Compaction, compaction);
+}
+
+static void
+compact_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+  Compaction *compaction = task_data;
+
+  g_task_return_boolean(task, compact_file(compaction->path, compaction->keep));
+}
+
+static void
+compact_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  History *history = user_data;
+  guint appended = history->appended - history->appended_before;
+
+  history->compacting = FALSE;
+
+  if(g_task_propagate_boolean(G_TASK(res), NULL)) {
+    reopen(history);
+    history->appended = appended;
+  }
+
+  /* the old log was still mapped by the thread, so clearing had to wait */
+  if(history->cleared) {
+    history->cleared = FALSE;
+    history_clear(history);
+  }
+
+  if(history->freed)
+    history_free(history);
+  else
+    write_pending(history);
+}
+
+/* rewrites the log in a thread, the caller has written the pending records */
+static void
+compact_async(History *history)
+{
+  Compaction *compaction = g_slice_new(Compaction);
+  GTask *task = g_task_new(NULL, NULL, compact_done, history);
+
+  compaction->path = g_strdup(history->path);
+  compaction->keep = history->keep;
+
+  history->compacting = TRUE;
+  history->appended_before = history->appended;
+
+  g_task_set_task_data(task, compaction, compaction_free);
+  g_task_run_in_thread(task, compact_thread);
+  g_object_unref(task);
+}
+
+static gboolean
+flush_cb(gpointer user_data)
+{
+  History *history = user_data;
+
+  history->flush_id = 0;
+  write_pending(history);
+
+  /* keep the log within a small multiple of what it holds */
+  if(history->appended > history->keep * 2 && !history->compacting)
+    compact_async(history);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+append(History *history, guint8 type, const HistoryEntry *entry)
+{
+  if(history->fd < 0)
+    return;
+
+  append_record(history->pending, type, entry);
+  history->appended++;
+
+  if(history->flush_id == 0)
+    history->flush_id = g_timeout_add_seconds(FLUSH_DELAY, flush_cb, history);
+}
+
+void
+history_append(History *history, const HistoryEntry *entry)
+{
+  append(history, RECORD_ADD, entry);
+}
+
+/**
+ * history_update:
+ * @history: the history
+ * @entry: the new contents of the notification with the same id
+ *
+ * Records that a notification was replaced in place.
+ **/
+void
+history_update(History *history, const HistoryEntry *entry)
+{
+  append(history, RECORD_UPDATE, entry);
+}
+
+void
+history_remove(History *history, guint64 id)
+{
+  HistoryEntry entry = { 0, };
+
+  entry.id = id;
+  append(history, RECORD_REMOVE, &entry);
+}
+
+/**
+ * history_clear:
+ * @history: the history
+ *
+ * Forgets all notifications.
+ **/
+void
+history_clear(History *history)
+{
+  /* nothing waiting may reach the file afterwards */
+  g_string_truncate(history->pending, 0);
+  write_pending(history);
+
+  if(history->compacting) {
+    history->cleared = TRUE;
+    return;
+  }
+
+  if(history->fd < 0)
+    return;
+
+  if(ftruncate(history->fd, 0) != 0)
+    g_warning("Could not clear the notification history: %s", g_strerror(errno));
+
+  history->appended = 0;
+}
+
+/**
+ * history_compact:
+ * @history: the history
+ *
+ * Rewrites the log with only the notifications worth keeping, blocking until
+ * it is on disk. Returns FALSE if the log could not be rewritten or a
+ * compaction is already running.
+ **/
+gboolean
+history_compact(History *history)
+{
+  if(history->compacting)
+    return FALSE;
+
+  write_pending(history);
+
+  if(!compact_file(history->path, history->keep))
+    return FALSE;
+
+  reopen(history);
+
+  return TRUE;
+}
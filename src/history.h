@@ -0,0 +1,40 @@
+/*
+ * history.h - An append-only log of notifications that survives restarts.
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _History History;
+
+/* the strings point into the log and are not terminated */
+typedef struct {
+  guint64      id;
+  gint64       timestamp;
+  const gchar *app_name;
+  gsize        app_name_length;
+  const gchar *summary;
+  gsize        summary_length;
+  const gchar *body;
+  gsize        body_length;
+} HistoryEntry;
+
+typedef void (*HistoryEntryFunc)(const HistoryEntry *entry, gpointer user_data);
+
+History *history_new(const gchar *path, guint keep);
+void     history_free(History *history);
+void     history_set_keep(History *history, guint keep);
+guint    history_load(History *history, HistoryEntryFunc func, gpointer user_data);
+void     history_append(History *history, const HistoryEntry *entry);
+void     history_update(History *history, const HistoryEntry *entry);
+void     history_remove(History *history, guint64 id);
+void     history_clear(History *history);
+gboolean history_compact(History *history);
+
+G_END_DECLS
+
+#endif /* __HISTORY_H__ */
@@ -19,8 +19,11 @@
  */
 
 #include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include "service.h"
 
 static void on_name_lost (gpointer instance G_GNUC_UNUSED, gpointer loop)
@@ -29,25 +32,128 @@ static void on_name_lost (gpointer instance G_GNUC_UNUSED, gpointer loop)
     g_main_loop_quit ((GMainLoop*)loop);
 }
 
-int main (int argc G_GNUC_UNUSED, char ** argv G_GNUC_UNUSED)
+/* bytes other than these are %-escaped in D-Bus addresses */
+static gchar * escape_address_value (const gchar *value)
 {
-    IndicatorNotificationsService * service;
+    GString *escaped = g_string_new (NULL);
+    const guchar *p;
+
+    for (p = (const guchar *) value; *p != '\0'; p++)
+    {
+        if (g_ascii_isalnum (*p) || strchr ("-_/.*", *p) != NULL)
+            g_string_append_c (escaped, *p);
+        else
+            g_string_append_printf (escaped, "%%%02x", *p);
+    }
+
+    return g_string_free (escaped, FALSE);
+}
+
+/* every socket in the directory is taken to be the socket of a message bus */
+static void add_bus_dir (GPtrArray *addresses, const gchar *dir_path)
+{
+    GError *error = NULL;
+    GDir *dir = g_dir_open (dir_path, 0, &error);
+    const gchar *name;
+
+    if (dir == NULL)
+    {
+        g_warning ("cannot read %s: %s", dir_path, error->message);
+        g_error_free (error);
+        return;
+    }
+
+    while ((name = g_dir_read_name (dir)) != NULL)
+    {
+        gchar *path = g_build_filename (dir_path, name, NULL);
+        GStatBuf st;
+
+        if (g_stat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+        {
+            gchar *escaped = escape_address_value (path);
+            g_ptr_array_add (addresses, g_strconcat ("unix:path=", escaped, NULL));
+            g_free (escaped);
+        }
+
+        g_free (path);
+    }
+
+    g_dir_close (dir);
+}
+
+int main (int argc, char ** argv)
+{
+    GPtrArray * services;
     GMainLoop * loop;
+    gchar ** bus_addresses = NULL;
+    gchar ** bus_dirs = NULL;
+    GError * error = NULL;
+    guint i;
+
+    GOptionEntry entries[] =
+    {
+        { "bus-address", 'a', 0, G_OPTION_ARG_STRING_ARRAY, &bus_addresses, "Watch the message bus at ADDRESS instead of the session bus, may be repeated", "ADDRESS" },
+        { "bus-dir", 'd', 0, G_OPTION_ARG_FILENAME_ARRAY, &bus_dirs, "Watch the message bus behind every socket in DIR, may be repeated", "DIR" },
+        { NULL }
+    };
 
     /* boilerplate i18n */
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
     textdomain (GETTEXT_PACKAGE);
 
+    GOptionContext * context = g_option_context_new (NULL);
+    g_option_context_add_main_entries (context, entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        g_option_context_free (context);
+        return 1;
+    }
+
+    g_option_context_free (context);
+
+    /* aggregator mode: one service per bus, all in this process */
+    GPtrArray * addresses = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; bus_addresses != NULL && bus_addresses[i] != NULL; i++)
+        g_ptr_array_add (addresses, g_strdup (bus_addresses[i]));
+
+    for (i = 0; bus_dirs != NULL && bus_dirs[i] != NULL; i++)
+        add_bus_dir (addresses, bus_dirs[i]);
+
     /* run */
-    service = indicator_notifications_service_new ();
     loop = g_main_loop_new (NULL, FALSE);
-    g_signal_connect (service, INDICATOR_NOTIFICATIONS_SERVICE_SIGNAL_NAME_LOST, G_CALLBACK(on_name_lost), loop);
-    g_main_loop_run (loop);
+    services = g_ptr_array_new_with_free_func (g_object_unref);
+
+    if (bus_addresses == NULL && bus_dirs == NULL)
+    {
+        IndicatorNotificationsService * service = indicator_notifications_service_new ();
+        g_signal_connect (service, INDICATOR_NOTIFICATIONS_SERVICE_SIGNAL_NAME_LOST, G_CALLBACK(on_name_lost), loop);
+        g_ptr_array_add (services, service);
+    }
+    else
+    {
+        /* losing one bus must not take the others down */
+        for (i = 0; i < addresses->len; i++)
+            g_ptr_array_add (services, indicator_notifications_service_new_for_address (g_ptr_array_index (addresses, i)));
+
+        g_message ("watching %u message buses", services->len);
+    }
+
+    if (services->len > 0)
+        g_main_loop_run (loop);
+    else
+        g_warning ("no message bus to watch");
 
     /* cleanup */
+    g_ptr_array_unref (services);
+    g_ptr_array_unref (addresses);
     g_main_loop_unref (loop);
-    g_clear_object (&service);
+    g_strfreev (bus_addresses);
+    g_strfreev (bus_dirs);
 
     return 0;
 }
@@ -0,0 +1,346 @@
+/*
+ * markup.c - Renders notification labels into a single buffer.
+ *
+ * A label is rendered twice with the same code: once without a buffer to
+ * measure it, then into a buffer of exactly that size. Escaping looks for the
+ * bytes that need it 16 at a time and passes everything else through in
+ * bulk, and produces the same output as g_markup_escape_text().
+ */
+
+#include <string.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "markup.h"
+#include "stats.h"
+#include "urlregex.h"
+
+/*
+ * Whether a byte may need escaping: the five markup characters, the control
+ * characters other than tab, newline and carriage return, DEL and the lead
+ * byte of the C1 controls.
+ */
+static inline gboolean
+is_special(guchar c)
+{
+  return c < 0x20 || c == '&' || c == '<' || c == '>' || c == '\'' || c == '"' || c == 0x7f || c == 0xc2;
+}
+
+/* the number of bytes at the start of text that can be copied as they are */
+static gsize
+clean_run(const guchar *text, gsize length)
+{
+  gsize pos = 0;
+
+#if defined(__SSE2__)
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i apos = _mm_set1_epi8('\'');
+  const __m128i quot = _mm_set1_epi8('"');
+  const __m128i del = _mm_set1_epi8(0x7f);
+  const __m128i c1 = _mm_set1_epi8((char) 0xc2);
+  const __m128i control = _mm_set1_epi8(0x1f);
+
+  for (; pos + 16 <= length; pos += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (text + pos));
+    __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, amp), _mm_cmpeq_epi8(block, lt)),
+                     _mm_or_si128(_mm_cmpeq_epi8(block, gt), _mm_cmpeq_epi8(block, apos))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, quot), _mm_cmpeq_epi8(block, del)),
+                     _mm_or_si128(_mm_cmpeq_epi8(block, c1),
+                                  /* unsigned block <= 0x1f */
+                                  _mm_cmpeq_epi8(_mm_min_epu8(block, control), block))));
+    int mask = _mm_movemask_epi8(hits);
+
+    if (mask != 0)
+      return pos + __builtin_ctz(mask);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; pos + 16 <= length; pos += 16) {
+    uint8x16_t block = vld1q_u8(text + pos);
+    uint8x16_t hits = vorrq_u8(
+        vorrq_u8(vorrq_u8(vceqq_u8(block, vdupq_n_u8('&')), vceqq_u8(block, vdupq_n_u8('<'))),
+                 vorrq_u8(vceqq_u8(block, vdupq_n_u8('>')), vceqq_u8(block, vdupq_n_u8('\'')))),
+        vorrq_u8(vorrq_u8(vceqq_u8(block, vdupq_n_u8('"')), vceqq_u8(block, vdupq_n_u8(0x7f))),
+                 vorrq_u8(vceqq_u8(block, vdupq_n_u8(0xc2)), vcltq_u8(block, vdupq_n_u8(0x20)))));
+
+    /* no cheap movemask, the scalar loop below finds the byte */
+    if (vmaxvq_u8(hits) != 0)
+      break;
+  }
+#endif
+
+  while (pos < length && !is_special(text[pos]))
+    pos++;
+
+  return pos;
+}
+
+/*
+ * Writes the escaped form of the character at text to out, unless out is
+ * NULL, and returns its length. used is set to the number of bytes of text
+ * it stands for.
+ */
+static gsize
+escape_char(gchar *out, const guchar *text, gsize length, gsize *used)
+{
+  const gchar *entity = NULL;
+  guint code = 0;
+
+  *used = 1;
+
+  switch (*text) {
+    case '&':
+      entity = "&amp;";
+      break;
+    case '<':
+      entity = "&lt;";
+      break;
+    case '>':
+      entity = "&gt;";
+      break;
+    case '\'':
+      entity = "&#39;";
+      break;
+    case '"':
+      entity = "&quot;";
+      break;
+    case 0xc2:
+      /* U+0080 to U+009F except U+0085 */
+      if (length >= 2 && text[1] >= 0x80 && text[1] <= 0x9f && text[1] != 0x85) {
+        code = text[1];
+        *used = 2;
+      }
+      break;
+    default:
+      if ((*text >= 0x1 && *text <= 0x8) || *text == 0xb || *text == 0xc || (*text >= 0xe && *text <= 0x1f) || *text == 0x7f)
+        code = *text;
+      break;
+  }
+
+  if (entity != NULL) {
+    gsize n = strlen(entity);
+
+    if (out != NULL)
+      memcpy(out, entity, n);
+    return n;
+  }
+
+  if (code != 0) {
+    static const gchar hex[] = "0123456789abcdef";
+    gchar buffer[8] = "&#x";
+    gsize n = 3;
+
+    if (code >= 0x10)
+      buffer[n++] = hex[code >> 4];
+    buffer[n++] = hex[code & 0xf];
+    buffer[n++] = ';';
+
+    if (out != NULL)
+      memcpy(out, buffer, n);
+    return n;
+  }
+
+  if (out != NULL)
+    memcpy(out, text, *used);
+  return *used;
+}
+
+/* escapes text to *out and advances it, or only measures if *out is NULL */
+static gsize
+emit_escaped(gchar **out, const gchar *text, gsize length)
+{
+  const guchar *p = (const guchar *) text;
+  gsize written = 0;
+
+  while (length > 0) {
+    gsize run = clean_run(p, length);
+
+    if (*out != NULL) {
+      memcpy(*out, p, run);
+      *out += run;
+    }
+    written += run;
+    p += run;
+    length -= run;
+
+    if (length > 0) {
+      gsize used;
+      gsize n = escape_char(*out, p, length, &used);
+
+      if (*out != NULL)
+        *out += n;
+      written += n;
+      p += used;
+      length -= used;
+    }
+  }
+
+  return written;
+}
+
+/* copies text that needs no escaping */
+static gsize
+emit_raw(gchar **out, const gchar *text, gsize length)
+{
+  if (*out != NULL) {
+    memcpy(*out, text, length);
+    *out += length;
+  }
+
+  return length;
+}
+
+#define emit_literal(out, literal) emit_raw(out, literal, sizeof(literal) - 1)
+
+/**
+ * markup_escaped_length:
+ * @text: the text, need not be terminated
+ * @length: the length of @text in bytes
+ *
+ * Returns the length of @text escaped by markup_escape_to().
+ **/
+gsize
+markup_escaped_length(const gchar *text, gsize length)
+{
+  gchar *out = NULL;
+
+  return emit_escaped(&out, text, length);
+}
+
+/**
+ * markup_escape_to:
+ * @out: a buffer of at least markup_escaped_length() bytes
+ * @text: the text, need not be terminated
+ * @length: the length of @text in bytes
+ *
+ * Escapes @text like g_markup_escape_text() and writes it to @out without a
+ * terminator. Returns the end of what was written.
+ **/
+gchar *
+markup_escape_to(gchar *out, const gchar *text, gsize length)
+{
+  emit_escaped(&out, text, length);
+
+  return out;
+}
+
+static gsize
+emit_body(gchar **out, const gchar *body, gsize length, GArray *spans)
+{
+  gsize written = 0;
+  gsize pos = 0;
+  guint i;
+
+  for (i = 0; spans != NULL && i < spans->len; i++) {
+    const UrlSpan *span = &g_array_index(spans, UrlSpan, i);
+    const gchar *rest;
+    gsize rest_length;
+    const gchar *prefix = urlregex_span_target(body, span, &rest, &rest_length);
+
+    written += emit_escaped(out, body + pos, span->start - pos);
+    written += emit_literal(out, "<a href=\"");
+    /* the prefixes are plain ascii */
+    written += emit_raw(out, prefix, strlen(prefix));
+    written += emit_escaped(out, rest, rest_length);
+    written += emit_literal(out, "\">");
+    written += emit_escaped(out, body + span->start, span->length);
+    written += emit_literal(out, "</a>");
+
+    pos = span->start + span->length;
+  }
+
+  written += emit_escaped(out, body + pos, length - pos);
+
+  return written;
+}
+
+static gsize
+emit_label(gchar **out, const HistoryEntry *entry, guint count, GArray *spans, const gchar *when, gsize when_length, const gchar *from)
+{
+  gsize written = 0;
+
+  written += emit_literal(out, "<b>");
+  written += emit_escaped(out, entry->summary, entry->summary_length);
+  written += emit_literal(out, "</b>");
+
+  if (count > 1) {
+    gchar repeats[16];
+
+    written += emit_literal(out, " \xc3\x97");
+    written += emit_raw(out, repeats, g_snprintf(repeats, sizeof repeats, "%u", count));
+  }
+
+  written += emit_literal(out, "\n");
+  written += emit_body(out, entry->body, entry->body_length, spans);
+  written += emit_literal(out, "\n<small><i>");
+  written += emit_escaped(out, when, when_length);
+  written += emit_literal(out, " ");
+  written += emit_raw(out, from, strlen(from));
+  written += emit_literal(out, " <b>");
+  written += emit_escaped(out, entry->app_name, entry->app_name_length);
+  written += emit_literal(out, "</b></i></small>");
+
+  return written;
+}
+
+/**
+ * markup_render_label:
+ * @entry: the notification
+ * @count: how many times it was repeated, shown as ×N above 1
+ * @from: the translated word between the time and the application name
+ *
+ * Renders the menu label of a notification, with its links, in one
+ * allocation. Only call this from the main thread.
+ **/
+gchar *
+markup_render_label(const HistoryEntry *entry, guint count, const gchar *from)
+{
+  /* reused by every label, so finding links does not allocate */
+  static GArray *spans = NULL;
+  GArray *body_spans = NULL;
+  time_t timestamp = (time_t) entry->timestamp;
+  struct tm local;
+  gchar when[128];
+  gchar *when_utf8 = NULL;
+  gsize when_length = 0;
+  gchar *label;
+  gchar *out = NULL;
+  gsize length;
+
+  if (localtime_r(&timestamp, &local) != NULL)
+    when_length = strftime(when, sizeof when, "%X %x", &local);
+
+  /* strftime() speaks the locale's charset, labels are UTF-8 */
+  if (when_length > 0 && !g_get_charset(NULL)) {
+    when_utf8 = g_locale_to_utf8(when, when_length, NULL, &when_length, NULL);
+    if (when_utf8 == NULL)
+      when_length = 0;
+  }
+
+  gint64 start = stats_stage_begin();
+
+  if (urlregex_may_contain_links(entry->body, entry->body_length)) {
+    if (spans == NULL)
+      spans = g_array_new(FALSE, FALSE, sizeof(UrlSpan));
+
+    g_array_set_size(spans, 0);
+    if (urlregex_scan(entry->body, entry->body_length, spans) > 0)
+      body_spans = spans;
+  }
+
+  stats_stage_end(STATS_STAGE_LINKIFY, start);
+
+  length = emit_label(&out, entry, count, body_spans, when_utf8 != NULL ? when_utf8 : when, when_length, from);
+  label = out = g_malloc(length + 1);
+  emit_label(&out, entry, count, body_spans, when_utf8 != NULL ? when_utf8 : when, when_length, from);
+  *out = '\0';
+
+  g_free(when_utf8);
+
+  return label;
+}
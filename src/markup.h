@@ -0,0 +1,19 @@
+/*
+ * markup.h - Renders notification labels into a single buffer.
+ */
+
+#ifndef __MARKUP_H__
+#define __MARKUP_H__
+
+#include <glib.h>
+#include "history.h"
+
+G_BEGIN_DECLS
+
+gsize  markup_escaped_length(const gchar *text, gsize length);
+gchar *markup_escape_to(gchar *out, const gchar *text, gsize length);
+gchar *markup_render_label(const HistoryEntry *entry, guint count, const gchar *from);
+
+G_END_DECLS
+
+#endif /* __MARKUP_H__ */
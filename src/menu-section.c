@@ -0,0 +1,237 @@
+/*
+ * menu-section.c - A GMenuModel subclass for a flat list of items that can change in place.
+ *
+ * GMenu can only insert or remove one item at a time and has no way to
+ * replace one, so every change costs a signal per item and a replacement
+ * costs two. Here items are plain attribute tables and any change is a
+ * single splice with a single items-changed.
+ */
+
+#include <string.h>
+#include "menu-section.h"
+#include "stats.h"
+
+static void menu_section_class_init(MenuSectionClass *klass);
+static void menu_section_init(MenuSection *self);
+static void menu_section_finalize(GObject *object);
+
+G_DEFINE_TYPE_WITH_PRIVATE(MenuSection, menu_section, G_TYPE_MENU_MODEL);
+
+static gboolean
+menu_section_is_mutable(GMenuModel *model)
+{
+  return TRUE;
+}
+
+static gint
+menu_section_get_n_items(GMenuModel *model)
+{
+  return MENU_SECTION(model)->priv->items->len;
+}
+
+static void
+menu_section_get_item_attributes(GMenuModel *model, gint position, GHashTable **table)
+{
+  MenuSection *self = MENU_SECTION(model);
+
+  *table = g_hash_table_ref(g_ptr_array_index(self->priv->items, position));
+}
+
+static void
+menu_section_get_item_links(GMenuModel *model, gint position, GHashTable **table)
+{
+  *table = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void
+menu_section_class_init(MenuSectionClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS(klass);
+  GMenuModelClass *model_class = G_MENU_MODEL_CLASS(klass);
+
+  object_class->finalize = menu_section_finalize;
+
+  model_class->is_mutable = menu_section_is_mutable;
+  model_class->get_n_items = menu_section_get_n_items;
+  model_class->get_item_attributes = menu_section_get_item_attributes;
+  model_class->get_item_links = menu_section_get_item_links;
+}
+
+static void
+menu_section_init(MenuSection *self)
+{
+  self->priv = menu_section_get_instance_private(self);
+
+  /* no free func, splices move the tables around themselves */
+  self->priv->items = g_ptr_array_new();
+}
+
+static void
+menu_section_finalize(GObject *object)
+{
+  MenuSection *self = MENU_SECTION(object);
+
+  g_ptr_array_foreach(self->priv->items, (GFunc) g_hash_table_unref, NULL);
+  g_ptr_array_unref(self->priv->items);
+
+  G_OBJECT_CLASS(menu_section_parent_class)->finalize(object);
+}
+
+MenuSection*
+menu_section_new(void)
+{
+  return MENU_SECTION(g_object_new(MENU_SECTION_TYPE, NULL));
+}
+
+/**
+ * menu_section_splice:
+ * @self: the section
+ * @position: where the change starts
+ * @removed: the number of items to remove at @position
+ * @added: (array length=n_added): attribute tables to insert at @position
+ * @n_added: the number of tables in @added
+ *
+ * Replaces @removed items with @n_added new ones and emits items-changed
+ * once. The section takes a reference to each table, which must not be
+ * modified afterwards.
+ **/
+void
+menu_section_splice(MenuSection *self, guint position, guint removed, GHashTable **added, guint n_added)
+{
+  g_return_if_fail(IS_MENU_SECTION(self));
+
+  GPtrArray *items = self->priv->items;
+  guint old_len = items->len;
+  guint i;
+
+  g_return_if_fail(position + removed <= old_len);
+
+  if(removed == 0 && n_added == 0)
+    return;
+
+  gint64 start = stats_trace_begin();
+
+  /* drop the removed tables, then move the tail to its new place */
+  for(i = 0; i < removed; i++)
+    g_hash_table_unref(g_ptr_array_index(items, position + i));
+
+  if(n_added > removed)
+    g_ptr_array_set_size(items, old_len + n_added - removed);
+
+  memmove(&items->pdata[position + n_added],
+          &items->pdata[position + removed],
+          (old_len - position - removed) * sizeof(gpointer));
+
+  for(i = 0; i < n_added; i++)
+    items->pdata[position + i] = g_hash_table_ref(added[i]);
+
+  if(n_added < removed)
+    g_ptr_array_set_size(items, old_len + n_added - removed);
+
+  g_menu_model_items_changed(G_MENU_MODEL(self), position, removed, n_added);
+  stats_trace_end("menu-splice", start);
+}
+
+void
+menu_section_insert(MenuSection *self, guint position, GHashTable *item)
+{
+  menu_section_splice(self, position, 0, &item, 1);
+}
+
+void
+menu_section_remove(MenuSection *self, guint position)
+{
+  menu_section_splice(self, position, 1, NULL, 0);
+}
+
+static gboolean
+item_equal(GHashTable *a, GHashTable *b)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  if(a == b)
+    return TRUE;
+
+  if(g_hash_table_size(a) != g_hash_table_size(b))
+    return FALSE;
+
+  g_hash_table_iter_init(&iter, a);
+  while(g_hash_table_iter_next(&iter, &key, &value)) {
+    GVariant *other = g_hash_table_lookup(b, key);
+
+    if(other == NULL || !g_variant_equal(value, other))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * menu_section_replace:
+ * @self: the section
+ * @position: the item to replace
+ * @item: its new attribute table
+ *
+ * Replaces an item, unless @item has the same attributes as the current one,
+ * in which case nothing is emitted at all.
+ **/
+void
+menu_section_replace(MenuSection *self, guint position, GHashTable *item)
+{
+  g_return_if_fail(IS_MENU_SECTION(self));
+  g_return_if_fail(position < self->priv->items->len);
+
+  if(item_equal(g_ptr_array_index(self->priv->items, position), item))
+    return;
+
+  menu_section_splice(self, position, 1, &item, 1);
+}
+
+void
+menu_section_remove_all(MenuSection *self)
+{
+  g_return_if_fail(IS_MENU_SECTION(self));
+
+  menu_section_splice(self, 0, self->priv->items->len, NULL, 0);
+}
+
+/**
+ * menu_section_item_new:
+ * @label: (nullable): the label
+ * @action: (nullable): the detailed action name
+ * @target: (nullable): the action target, sunk if floating
+ *
+ * Creates an attribute table for a menu item, in the form GMenu uses.
+ **/
+GHashTable*
+menu_section_item_new(const gchar *label, const gchar *action, GVariant *target)
+{
+  GHashTable *item = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+
+  if(label != NULL)
+    menu_section_item_set_attribute(item, G_MENU_ATTRIBUTE_LABEL, g_variant_new_string(label));
+
+  if(action != NULL)
+    menu_section_item_set_attribute(item, G_MENU_ATTRIBUTE_ACTION, g_variant_new_string(action));
+
+  if(target != NULL)
+    menu_section_item_set_attribute(item, G_MENU_ATTRIBUTE_TARGET, target);
+
+  return item;
+}
+
+/**
+ * menu_section_item_set_attribute:
+ * @item: an attribute table from menu_section_item_new()
+ * @attribute: the attribute name
+ * @value: the value, sunk if floating
+ *
+ * Sets an attribute on an item that has not been added to a section yet.
+ **/
+void
+menu_section_item_set_attribute(GHashTable *item, const gchar *attribute, GVariant *value)
+{
+  g_hash_table_insert(item, g_strdup(attribute), g_variant_ref_sink(value));
+}
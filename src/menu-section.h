@@ -0,0 +1,54 @@
+/*
+ * menu-section.h - A GMenuModel subclass for a flat list of items that can change in place.
+ */
+
+#ifndef __MENU_SECTION_H__
+#define __MENU_SECTION_H__
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define MENU_SECTION_TYPE             (menu_section_get_type ())
+#define MENU_SECTION(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), MENU_SECTION_TYPE, MenuSection))
+#define MENU_SECTION_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), MENU_SECTION_TYPE, MenuSectionClass))
+#define IS_MENU_SECTION(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), MENU_SECTION_TYPE))
+#define IS_MENU_SECTION_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), MENU_SECTION_TYPE))
+
+typedef struct _MenuSection        MenuSection;
+typedef struct _MenuSectionClass   MenuSectionClass;
+typedef struct _MenuSectionPrivate MenuSectionPrivate;
+
+struct _MenuSection
+{
+  GMenuModel          parent;
+  MenuSectionPrivate *priv;
+};
+
+struct _MenuSectionClass
+{
+  GMenuModelClass parent_class;
+};
+
+struct _MenuSectionPrivate {
+  /* attribute tables, one per item */
+  GPtrArray *items;
+};
+
+GType        menu_section_get_type(void);
+MenuSection *menu_section_new(void);
+void         menu_section_splice(MenuSection *self, guint position, guint removed,
+                                 GHashTable **added, guint n_added);
+void         menu_section_insert(MenuSection *self, guint position, GHashTable *item);
+void         menu_section_remove(MenuSection *self, guint position);
+void         menu_section_replace(MenuSection *self, guint position, GHashTable *item);
+void         menu_section_remove_all(MenuSection *self);
+
+GHashTable  *menu_section_item_new(const gchar *label, const gchar *action, GVariant *target);
+void         menu_section_item_set_attribute(GHashTable *item, const gchar *attribute, GVariant *value);
+
+G_END_DECLS
+
+#endif /* __MENU_SECTION_H__ */
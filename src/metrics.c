@@ -0,0 +1,119 @@
+/*
+ * metrics.c - Exports the pipeline counters and histograms on the bus.
+ *
+ * A single GetStats call returns everything as a{sv}, so a scraper needs one
+ * round trip. Counters are "<name>" (u), stage histograms are
+ * "<stage>-histogram" (au), bucket i counting durations from 2^i up to
+ * 2^(i+1) nanoseconds. The owner adds its own figures through a callback.
+ *
+ * The counters and histograms belong to the process. When it watches several
+ * buses, every bus reports the same sums over all of them, which the "scope"
+ * key ("process") says. Only the owner's figures are per bus.
+ */
+
+#include "metrics.h"
+#include "stats.h"
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='" METRICS_INTERFACE "'>"
+  "    <method name='GetStats'>"
+  "      <arg type='a{sv}' name='stats' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+typedef struct {
+  MetricsFillFunc fill;
+  gpointer        user_data;
+} Exported;
+
+static GDBusInterfaceInfo*
+interface_info(void)
+{
+  static gsize info = 0;
+
+  if (g_once_init_enter(&info)) {
+    GDBusNodeInfo *node = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+    GDBusInterfaceInfo *iface = g_dbus_interface_info_ref(node->interfaces[0]);
+
+    g_dbus_node_info_unref(node);
+    g_once_init_leave(&info, (gsize) iface);
+  }
+
+  return (GDBusInterfaceInfo *) info;
+}
+
+static GVariant*
+get_stats(Exported *exported)
+{
+  GVariantBuilder builder;
+  guint buckets[STATS_HISTOGRAM_BUCKETS];
+  guint i;
+
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_add(&builder, "{sv}", "scope", g_variant_new_string("process"));
+
+  for (i = 0; i < STATS_N_COUNTERS; i++)
+    g_variant_builder_add(&builder, "{sv}", stats_counter_name(i), g_variant_new_uint32(stats_get_count(i)));
+
+  for (i = 0; i < STATS_N_STAGES; i++) {
+    gchar *key = g_strconcat(stats_stage_name(i), "-histogram", NULL);
+
+    stats_get_histogram(i, buckets);
+    g_variant_builder_add(&builder, "{sv}", key,
+                          g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, buckets, STATS_HISTOGRAM_BUCKETS, sizeof(guint32)));
+    g_free(key);
+  }
+
+  if (exported->fill != NULL)
+    exported->fill(&builder, exported->user_data);
+
+  return g_variant_builder_end(&builder);
+}
+
+static void
+method_call(GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+            const gchar *interface_name, const gchar *method_name, GVariant *parameters,
+            GDBusMethodInvocation *invocation, gpointer user_data)
+{
+  if (g_strcmp0(method_name, "GetStats") == 0) {
+    GVariant *stats = get_stats(user_data);
+
+    g_dbus_method_invocation_return_value(invocation, g_variant_new_tuple(&stats, 1));
+    return;
+  }
+
+  g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                        "Unknown method %s", method_name);
+}
+
+static const GDBusInterfaceVTable vtable = {
+  method_call,
+  NULL,
+  NULL
+};
+
+/**
+ * metrics_export:
+ * @connection: the connection to export on
+ * @object_path: where to export the interface
+ * @fill: (nullable): adds the owner's figures to each reply
+ * @user_data: passed to @fill
+ * @error: return location for an error
+ *
+ * Exports the metrics interface. Returns the registration id to pass to
+ * g_dbus_connection_unregister_object(), or 0 on error.
+ **/
+guint
+metrics_export(GDBusConnection *connection, const gchar *object_path,
+               MetricsFillFunc fill, gpointer user_data, GError **error)
+{
+  Exported *exported = g_new0(Exported, 1);
+
+  exported->fill = fill;
+  exported->user_data = user_data;
+
+  return g_dbus_connection_register_object(connection, object_path, interface_info(), &vtable,
+                                           exported, g_free, error);
+}
@@ -0,0 +1,23 @@
+/*
+ * metrics.h - Exports the pipeline counters and histograms on the bus.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define METRICS_INTERFACE "org.ayatana.indicator.notifications.Metrics"
+
+/* adds the owner's own figures to the reply of GetStats */
+typedef void (*MetricsFillFunc)(GVariantBuilder *builder, gpointer user_data);
+
+guint metrics_export(GDBusConnection *connection, const gchar *object_path,
+                     MetricsFillFunc fill, gpointer user_data, GError **error);
+
+G_END_DECLS
+
+#endif /* __METRICS_H__ */
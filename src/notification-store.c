@@ -0,0 +1,488 @@
+/*
+ * notification-store.c - A fixed-capacity history of notifications, newest first.
+ *
+ * All records live in one array allocated up front. Live records are chained
+ * from newest to oldest through their slot indices and free slots are chained
+ * through the same links, so inserting, dropping the oldest record and
+ * removing any record are all O(1) and the store only allocates again when
+ * its capacity is raised. Lowering it keeps the array, the slots beyond the
+ * new capacity just stay free.
+ *
+ * Every record gets an id that is never reused, and an index maps ids back to
+ * slots so a record can be found without walking the history.
+ *
+ * Records only hold the raw text of a notification. Rendering it is left to
+ * whoever shows it, so most of the history costs little more than its text.
+ */
+
+#include <string.h>
+#include "notification-store.h"
+
+struct _NotificationStore
+{
+  NotificationRecord *records;
+  /* slots in the array, and how many of them may be used */
+  guint               allocated;
+  guint               capacity;
+  guint               length;
+  guint32             newest;
+  guint32             oldest;
+  guint32             free_head;
+  guint64             next_id;
+  GHashTable         *index;
+  /* bytes of text held by all records */
+  gsize               text_size;
+};
+
+static gsize
+record_text_size(NotificationRecord *record)
+{
+  return record->text != NULL ? record->app_name_length + record->summary_length + record->body_length + 3 : 0;
+}
+
+static void
+record_clear(NotificationStore *store, NotificationRecord *record)
+{
+  store->text_size -= record_text_size(record);
+  g_free(record->text);
+  record->text = NULL;
+  record->app_name_length = 0;
+  record->summary_length = 0;
+  record->body_length = 0;
+  record->hash = 0;
+  record->count = 0;
+  record->id = 0;
+  record->timestamp = 0;
+  record->server_id = 0;
+  record->in_use = FALSE;
+}
+
+static void
+store_reset(NotificationStore *store)
+{
+  guint i;
+
+  for (i = 0; i < store->allocated; i++) {
+    store->records[i].newer = NOTIFICATION_STORE_NONE;
+    store->records[i].older = (i + 1 < store->allocated) ? i + 1 : NOTIFICATION_STORE_NONE;
+  }
+
+  store->length = 0;
+  store->newest = NOTIFICATION_STORE_NONE;
+  store->oldest = NOTIFICATION_STORE_NONE;
+  store->free_head = 0;
+}
+
+/**
+ * notification_store_new:
+ * @capacity: the maximum number of records, at least 1
+ *
+ * Creates an empty store.
+ **/
+NotificationStore *
+notification_store_new(guint capacity)
+{
+  NotificationStore *store = g_new0(NotificationStore, 1);
+
+  store->capacity = MAX(capacity, 1);
+  store->allocated = store->capacity;
+  store->records = g_new0(NotificationRecord, store->allocated);
+  store->next_id = 1;
+  /* keys point at the id of the record they index */
+  store->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+  store_reset(store);
+
+  return store;
+}
+
+/**
+ * notification_store_free:
+ * @store: the store
+ *
+ * Frees the store and drops all records.
+ **/
+void
+notification_store_free(NotificationStore *store)
+{
+  guint i;
+
+  for (i = 0; i < store->allocated; i++) {
+    if (store->records[i].in_use)
+      record_clear(store, &store->records[i]);
+  }
+
+  g_hash_table_destroy(store->index);
+  g_free(store->records);
+  g_free(store);
+}
+
+guint
+notification_store_get_capacity(NotificationStore *store)
+{
+  return store->capacity;
+}
+
+/**
+ * notification_store_set_capacity:
+ * @store: the store
+ * @capacity: the new maximum number of records, at least 1
+ *
+ * Changes how many records the store holds. The oldest records are dropped
+ * if there are more, callers that keep slots elsewhere drop them first.
+ * Slots of the remaining records stay the same.
+ **/
+void
+notification_store_set_capacity(NotificationStore *store, guint capacity)
+{
+  guint i;
+
+  capacity = MAX(capacity, 1);
+
+  while (store->length > capacity)
+    notification_store_remove(store, store->oldest);
+
+  if (capacity > store->allocated) {
+    store->records = g_renew(NotificationRecord, store->records, capacity);
+    memset(store->records + store->allocated, 0, (capacity - store->allocated) * sizeof(NotificationRecord));
+
+    for (i = store->allocated; i < capacity; i++) {
+      store->records[i].newer = NOTIFICATION_STORE_NONE;
+      store->records[i].older = (i + 1 < capacity) ? i + 1 : store->free_head;
+    }
+
+    store->free_head = store->allocated;
+    store->allocated = capacity;
+
+    /* the keys point into the array that just moved */
+    g_hash_table_remove_all(store->index);
+    for (i = 0; i < store->allocated; i++) {
+      if (store->records[i].in_use)
+        g_hash_table_insert(store->index, &store->records[i].id, GUINT_TO_POINTER(i));
+    }
+  }
+
+  store->capacity = capacity;
+}
+
+guint
+notification_store_get_length(NotificationStore *store)
+{
+  return store->length;
+}
+
+/**
+ * notification_store_get_size:
+ * @store: the store
+ *
+ * Returns the bytes used by the store and the text of its records.
+ **/
+gsize
+notification_store_get_size(NotificationStore *store)
+{
+  return sizeof(NotificationStore) + store->allocated * sizeof(NotificationRecord) + store->text_size;
+}
+
+gboolean
+notification_store_is_full(NotificationStore *store)
+{
+  return store->length >= store->capacity;
+}
+
+/**
+ * notification_store_prepend:
+ * @store: the store
+ *
+ * Adds an empty record with a fresh id in front of all others, dropping the
+ * oldest record first if the store is full. Returns the slot of the new
+ * record.
+ **/
+guint
+notification_store_prepend(NotificationStore *store)
+{
+  return notification_store_prepend_with_id(store, store->next_id);
+}
+
+/**
+ * notification_store_prepend_with_id:
+ * @store: the store
+ * @id: the id of a record restored from elsewhere, not in the store
+ *
+ * Like notification_store_prepend(), but with a given id. Later records get
+ * ids above @id.
+ **/
+guint
+notification_store_prepend_with_id(NotificationStore *store, guint64 id)
+{
+  NotificationRecord *record;
+  guint32 slot;
+
+  g_return_val_if_fail(id != 0, NOTIFICATION_STORE_NONE);
+
+  if (store->length >= store->capacity)
+    notification_store_remove(store, store->oldest);
+
+  slot = store->free_head;
+  record = &store->records[slot];
+  store->free_head = record->older;
+
+  record->in_use = TRUE;
+  record->id = id;
+  record->count = 1;
+  store->next_id = MAX(store->next_id, id + 1);
+  g_hash_table_insert(store->index, &record->id, GUINT_TO_POINTER(slot));
+  record->newer = NOTIFICATION_STORE_NONE;
+  record->older = store->newest;
+
+  if (store->newest != NOTIFICATION_STORE_NONE)
+    store->records[store->newest].newer = slot;
+  else
+    store->oldest = slot;
+
+  store->newest = slot;
+  store->length++;
+
+  return slot;
+}
+
+/**
+ * notification_store_set_text:
+ * @store: the store
+ * @slot: a live slot
+ * @app_name: the application name, need not be terminated
+ * @app_name_length: its length in bytes
+ * @summary: the summary, need not be terminated
+ * @summary_length: its length in bytes
+ * @body: the body, need not be terminated
+ * @body_length: its length in bytes
+ *
+ * Copies the text of a notification into the record in @slot, replacing any
+ * text it had.
+ **/
+void
+notification_store_set_text(NotificationStore *store, guint slot,
+                            const gchar *app_name, gsize app_name_length,
+                            const gchar *summary, gsize summary_length,
+                            const gchar *body, gsize body_length)
+{
+  g_return_if_fail(slot < store->allocated);
+
+  NotificationRecord *record = &store->records[slot];
+  gchar *text = g_malloc(app_name_length + summary_length + body_length + 3);
+  gchar *p = text;
+
+  memcpy(p, app_name, app_name_length);
+  p += app_name_length;
+  *p++ = '\0';
+  memcpy(p, summary, summary_length);
+  p += summary_length;
+  *p++ = '\0';
+  memcpy(p, body, body_length);
+  p += body_length;
+  *p = '\0';
+
+  store->text_size -= record_text_size(record);
+  g_free(record->text);
+  record->text = text;
+  record->app_name_length = app_name_length;
+  record->summary_length = summary_length;
+  record->body_length = body_length;
+  record->hash = notification_store_hash_text(app_name, app_name_length, summary, summary_length, body, body_length);
+  store->text_size += record_text_size(record);
+}
+
+/* FNV-1a, with a separator so moving text between fields changes the hash */
+static guint32
+hash_bytes(guint32 hash, const gchar *data, gsize length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    hash = (hash ^ (guchar) data[i]) * 16777619u;
+
+  return (hash ^ 0xff) * 16777619u;
+}
+
+/**
+ * notification_store_hash_text:
+ * @app_name: the application name, need not be terminated
+ * @app_name_length: its length in bytes
+ * @summary: the summary, need not be terminated
+ * @summary_length: its length in bytes
+ * @body: the body, need not be terminated
+ * @body_length: its length in bytes
+ *
+ * Returns the hash a record with this text has, to look for repeats.
+ **/
+guint32
+notification_store_hash_text(const gchar *app_name, gsize app_name_length,
+                             const gchar *summary, gsize summary_length,
+                             const gchar *body, gsize body_length)
+{
+  guint32 hash = 2166136261u;
+
+  hash = hash_bytes(hash, app_name, app_name_length);
+  hash = hash_bytes(hash, summary, summary_length);
+  hash = hash_bytes(hash, body, body_length);
+
+  return hash;
+}
+
+/**
+ * notification_record_text_equal:
+ * @record: a live record
+ * @app_name: the application name, need not be terminated
+ * @app_name_length: its length in bytes
+ * @summary: the summary, need not be terminated
+ * @summary_length: its length in bytes
+ * @body: the body, need not be terminated
+ * @body_length: its length in bytes
+ *
+ * Returns whether @record holds exactly this text.
+ **/
+gboolean
+notification_record_text_equal(NotificationRecord *record,
+                               const gchar *app_name, gsize app_name_length,
+                               const gchar *summary, gsize summary_length,
+                               const gchar *body, gsize body_length)
+{
+  const gchar *text = record->text;
+
+  if (text == NULL
+      || record->app_name_length != app_name_length
+      || record->summary_length != summary_length
+      || record->body_length != body_length)
+    return FALSE;
+
+  return memcmp(text, app_name, app_name_length) == 0
+    && memcmp(text + app_name_length + 1, summary, summary_length) == 0
+    && memcmp(text + app_name_length + summary_length + 2, body, body_length) == 0;
+}
+
+/**
+ * notification_store_remove:
+ * @store: the store
+ * @slot: a slot returned by notification_store_prepend()
+ *
+ * Drops the record in @slot.
+ **/
+void
+notification_store_remove(NotificationStore *store, guint slot)
+{
+  g_return_if_fail(slot < store->allocated);
+
+  NotificationRecord *record = &store->records[slot];
+
+  g_return_if_fail(record->in_use);
+
+  if (record->newer != NOTIFICATION_STORE_NONE)
+    store->records[record->newer].older = record->older;
+  else
+    store->newest = record->older;
+
+  if (record->older != NOTIFICATION_STORE_NONE)
+    store->records[record->older].newer = record->newer;
+  else
+    store->oldest = record->newer;
+
+  g_hash_table_remove(store->index, &record->id);
+  record_clear(store, record);
+  record->newer = NOTIFICATION_STORE_NONE;
+  record->older = store->free_head;
+  store->free_head = slot;
+  store->length--;
+}
+
+/**
+ * notification_store_clear:
+ * @store: the store
+ *
+ * Drops all records.
+ **/
+void
+notification_store_clear(NotificationStore *store)
+{
+  guint32 slot;
+
+  g_hash_table_remove_all(store->index);
+
+  for (slot = store->newest; slot != NOTIFICATION_STORE_NONE; slot = store->records[slot].older)
+    record_clear(store, &store->records[slot]);
+
+  store_reset(store);
+}
+
+/**
+ * notification_store_get:
+ * @store: the store
+ * @slot: a live slot
+ *
+ * Returns the record in @slot, owned by the store.
+ **/
+NotificationRecord *
+notification_store_get(NotificationStore *store, guint slot)
+{
+  g_return_val_if_fail(slot < store->allocated, NULL);
+
+  return &store->records[slot];
+}
+
+/**
+ * notification_store_lookup:
+ * @store: the store
+ * @id: a record id
+ *
+ * Returns the slot of the record with @id, or NOTIFICATION_STORE_NONE if it
+ * has been dropped.
+ **/
+guint
+notification_store_lookup(NotificationStore *store, guint64 id)
+{
+  gpointer slot;
+
+  if (!g_hash_table_lookup_extended(store->index, &id, NULL, &slot))
+    return NOTIFICATION_STORE_NONE;
+
+  return GPOINTER_TO_UINT(slot);
+}
+
+guint
+notification_store_newest(NotificationStore *store)
+{
+  return store->newest;
+}
+
+guint
+notification_store_oldest(NotificationStore *store)
+{
+  return store->oldest;
+}
+
+/**
+ * notification_store_newer:
+ * @store: the store
+ * @slot: a live slot
+ *
+ * Returns the slot of the next newer record, or NOTIFICATION_STORE_NONE.
+ **/
+guint
+notification_store_newer(NotificationStore *store, guint slot)
+{
+  g_return_val_if_fail(slot < store->allocated, NOTIFICATION_STORE_NONE);
+
+  return store->records[slot].newer;
+}
+
+/**
+ * notification_store_older:
+ * @store: the store
+ * @slot: a live slot
+ *
+ * Returns the slot of the next older record, or NOTIFICATION_STORE_NONE.
+ **/
+guint
+notification_store_older(NotificationStore *store, guint slot)
+{
+  g_return_val_if_fail(slot < store->allocated, NOTIFICATION_STORE_NONE);
+
+  return store->records[slot].older;
+}
@@ -0,0 +1,70 @@
+/*
+ * notification-store.h - A fixed-capacity history of notifications, newest first.
+ */
+
+#ifndef __NOTIFICATION_STORE_H__
+#define __NOTIFICATION_STORE_H__
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define NOTIFICATION_STORE_NONE G_MAXUINT32
+
+typedef struct _NotificationStore  NotificationStore;
+typedef struct _NotificationRecord NotificationRecord;
+
+struct _NotificationRecord
+{
+  guint64     id;
+  gint64      timestamp;
+  guint32     server_id;
+  /* app name, summary and body, each followed by a nul, in one block */
+  gchar      *text;
+  guint32     app_name_length;
+  guint32     summary_length;
+  guint32     body_length;
+  /* of the text, see notification_store_hash_text() */
+  guint32     hash;
+  /* how many identical notifications the record stands for */
+  guint32     count;
+
+  /*< private >*/
+  guint32     newer;
+  guint32     older;
+  gboolean    in_use;
+};
+
+NotificationStore  *notification_store_new(guint capacity);
+void                notification_store_free(NotificationStore *store);
+guint               notification_store_get_capacity(NotificationStore *store);
+void                notification_store_set_capacity(NotificationStore *store, guint capacity);
+guint               notification_store_get_length(NotificationStore *store);
+gsize               notification_store_get_size(NotificationStore *store);
+gboolean            notification_store_is_full(NotificationStore *store);
+guint               notification_store_prepend(NotificationStore *store);
+guint               notification_store_prepend_with_id(NotificationStore *store, guint64 id);
+void                notification_store_set_text(NotificationStore *store, guint slot,
+                                                const gchar *app_name, gsize app_name_length,
+                                                const gchar *summary, gsize summary_length,
+                                                const gchar *body, gsize body_length);
+guint32             notification_store_hash_text(const gchar *app_name, gsize app_name_length,
+                                                 const gchar *summary, gsize summary_length,
+                                                 const gchar *body, gsize body_length);
+gboolean            notification_record_text_equal(NotificationRecord *record,
+                                                  const gchar *app_name, gsize app_name_length,
+                                                  const gchar *summary, gsize summary_length,
+                                                  const gchar *body, gsize body_length);
+void                notification_store_remove(NotificationStore *store, guint slot);
+void                notification_store_clear(NotificationStore *store);
+NotificationRecord *notification_store_get(NotificationStore *store, guint slot);
+guint               notification_store_lookup(NotificationStore *store, guint64 id);
+guint               notification_store_newest(NotificationStore *store);
+guint               notification_store_oldest(NotificationStore *store);
+guint               notification_store_newer(NotificationStore *store, guint slot);
+guint               notification_store_older(NotificationStore *store, guint slot);
+
+G_END_DECLS
+
+#endif /* __NOTIFICATION_STORE_H__ */
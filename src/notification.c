@@ -14,9 +14,13 @@
 #define COLUMN_HINTS          6
 #define COLUMN_EXPIRE_TIMEOUT 7
 
-#define COLUMN_COUNT 8
-
 #define X_CANONICAL_PRIVATE_SYNCHRONOUS "x-canonical-private-synchronous"
+#define URGENCY_HINT "urgency"
+
+#define NOTIFY_SIGNATURE "(susssasa{sv}i)"
+
+static gboolean is_private_hint(const gchar *private_string);
+static gboolean is_blank(const gchar *text);
 
 static void notification_class_init(NotificationClass *klass);
 static void notification_init(Notification *self);
@@ -36,14 +40,19 @@ notification_init(Notification *self)
 {
   self->priv = notification_get_instance_private(self);
 
+  self->priv->message_body = NULL;
   self->priv->app_name = NULL;
   self->priv->replaces_id = 0;
   self->priv->app_icon = NULL;
   self->priv->summary = NULL;
+  self->priv->summary_length = 0;
   self->priv->body = NULL;
+  self->priv->body_length = 0;
   self->priv->expire_timeout = 0;
   self->priv->timestamp = NULL;
   self->priv->is_private = FALSE;
+  self->priv->urgency = NOTIFICATION_URGENCY_NORMAL;
+  self->priv->id = 0;
 }
 
 static void
@@ -51,24 +60,15 @@ notification_dispose(GObject *object)
 {
   Notification *self = NOTIFICATION(object);
 
-  if(self->priv->app_name != NULL) {
-    g_free(self->priv->app_name);
-    self->priv->app_name = NULL;
-  }
-
-  if(self->priv->app_icon != NULL) {
-    g_free(self->priv->app_icon);
-    self->priv->app_icon = NULL;
-  }
-
-  if(self->priv->summary != NULL) {
-    g_free(self->priv->summary);
-    self->priv->summary = NULL;
-  }
+  /* the strings all point into the message body */
+  self->priv->app_name = NULL;
+  self->priv->app_icon = NULL;
+  self->priv->summary = NULL;
+  self->priv->body = NULL;
 
-  if(self->priv->body != NULL) {
-    g_free(self->priv->body);
-    self->priv->body = NULL;
+  if(self->priv->message_body != NULL) {
+    g_variant_unref(self->priv->message_body);
+    self->priv->message_body = NULL;
   }
 
   if(self->priv->timestamp != NULL) {
@@ -85,81 +85,195 @@ notification_new(void)
   return NOTIFICATION(g_object_new(NOTIFICATION_TYPE, NULL));
 }
 
+/*
+ * Returns the part of text without leading and trailing whitespace, the
+ * same span g_strstrip() would keep, without touching the string.
+ */
+static const gchar*
+trim_view(const gchar *text, gsize *length)
+{
+  const gchar *end = text + strlen(text);
+
+  while((text < end) && g_ascii_isspace(*text))
+    text++;
+
+  while((end > text) && g_ascii_isspace(end[-1]))
+    end--;
+
+  *length = end - text;
+
+  return text;
+}
+
+/**
+ * notification_new_from_dbus_message:
+ * @message: an org.freedesktop.Notifications.Notify method call
+ *
+ * Creates a Notification that borrows its strings from the message body.
+ * Returns NULL if the body does not have the Notify signature.
+ **/
 Notification*
 notification_new_from_dbus_message(GDBusMessage *message)
 {
+  GVariant *body = g_dbus_message_get_body(message);
+  GVariant *hints = NULL, *value = NULL;
+  const gchar *summary = NULL, *text = NULL;
+
+  if((body == NULL) || !g_variant_is_of_type(body, G_VARIANT_TYPE(NOTIFY_SIGNATURE))) {
+    g_debug("Ignoring Notify call with signature %s",
+            body != NULL ? g_variant_get_type_string(body) : "()");
+    return NULL;
+  }
+
   Notification *self = notification_new();
 
   /* timestamp */
   self->priv->timestamp = g_date_time_new_now_local();
 
-  GVariant *body = g_dbus_message_get_body(message);
-  GVariant *child = NULL, *value = NULL;
-  g_assert(g_variant_is_of_type(body, G_VARIANT_TYPE_TUPLE));
-  g_assert(g_variant_n_children(body) == COLUMN_COUNT);
-
-  /* app_name */
-  child = g_variant_get_child_value(body, COLUMN_APP_NAME);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->app_name = g_variant_dup_string(child,
-      &(self->priv->app_name_length));
-  g_variant_unref(child);
-
-  /* replaces_id */
-  child = g_variant_get_child_value(body, COLUMN_REPLACES_ID);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_UINT32));
-  self->priv->replaces_id = g_variant_get_uint32(child);
-  g_variant_unref(child);
-
-  /* app_icon */
-  child = g_variant_get_child_value(body, COLUMN_APP_ICON);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->app_icon = g_variant_dup_string(child,
-      &(self->priv->app_icon_length));
-  g_variant_unref(child);
-
-  /* summary */
-  child = g_variant_get_child_value(body, COLUMN_SUMMARY);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->summary = g_variant_dup_string(child,
-      &(self->priv->summary_length));
-  g_strstrip(self->priv->summary);
-  self->priv->summary_length = strlen(self->priv->summary);
-  g_variant_unref(child);
-
-  /* body */
-  child = g_variant_get_child_value(body, COLUMN_BODY);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->body = g_variant_dup_string(child,
-      &(self->priv->body_length));
-  g_strstrip(self->priv->body);
-  self->priv->body_length = strlen(self->priv->body);
-  g_variant_unref(child);
-
-  /* hints */
-  child = g_variant_get_child_value(body, COLUMN_HINTS);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_DICTIONARY));
+  self->priv->message_body = g_variant_ref(body);
+  g_variant_get(body, "(&su&s&s&s@as@a{sv}i)",
+                &self->priv->app_name,
+                &self->priv->replaces_id,
+                &self->priv->app_icon,
+                &summary,
+                &text,
+                NULL,
+                &hints,
+                &self->priv->expire_timeout);
+
+  self->priv->summary = trim_view(summary, &self->priv->summary_length);
+  self->priv->body = trim_view(text, &self->priv->body_length);
 
   /* check for volume hint */
-  value = g_variant_lookup_value(child, X_CANONICAL_PRIVATE_SYNCHRONOUS, G_VARIANT_TYPE_STRING);
+  value = g_variant_lookup_value(hints, X_CANONICAL_PRIVATE_SYNCHRONOUS, G_VARIANT_TYPE_STRING);
   if(value != NULL) {
-    const gchar *private_string = g_variant_get_string(value, NULL);
+    self->priv->is_private = is_private_hint(g_variant_get_string(value, NULL));
     g_variant_unref(value);
     value = NULL;
+  }
 
-    if((g_strcmp0(private_string, "volume") == 0) ||
-       (g_strcmp0(private_string, "brightness") == 0) ||
-       (g_strcmp0(private_string, "indicator-sound") == 0)) {
-      self->priv->is_private = TRUE;
-    }
+  value = g_variant_lookup_value(hints, URGENCY_HINT, G_VARIANT_TYPE_BYTE);
+  if(value != NULL) {
+    self->priv->urgency = MIN(g_variant_get_byte(value), NOTIFICATION_URGENCY_CRITICAL);
+    g_variant_unref(value);
+    value = NULL;
   }
 
-  g_variant_unref(child);
-  child = NULL;
+  g_variant_unref(hints);
+  hints = NULL;
 
   return self;
 }
 
+static gboolean
+is_private_hint(const gchar *private_string)
+{
+  return (g_strcmp0(private_string, "volume") == 0) ||
+         (g_strcmp0(private_string, "brightness") == 0) ||
+         (g_strcmp0(private_string, "indicator-sound") == 0);
+}
+
+static gboolean
+is_blank(const gchar *text)
+{
+  for(; *text != '\0'; text++) {
+    if(!g_ascii_isspace(*text))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static const gchar *urgency_names[] = {
+  "low",
+  "normal",
+  "critical"
+};
+
+/**
+ * notification_prefilter:
+ * @message: an org.freedesktop.Notifications.Notify method call
+ * @rules: (nullable): the filter rules
+ *
+ * Decides whether @message is worth turning into a Notification, reading
+ * only the fields it needs straight from the message body. Fields no rule
+ * looks at are never read. Safe to call from the GDBus worker thread.
+ **/
+NotificationVerdict
+notification_prefilter(GDBusMessage *message, RuleSet *rules)
+{
+  GVariant *body = g_dbus_message_get_body(message);
+  GVariant *hints;
+  GVariant *value;
+  const gchar *text;
+  gboolean blank;
+
+  if(body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE(NOTIFY_SIGNATURE)))
+    return NOTIFICATION_VERDICT_MALFORMED;
+
+  /* volume, brightness and other on-screen displays */
+  hints = g_variant_get_child_value(body, COLUMN_HINTS);
+  value = g_variant_lookup_value(hints, X_CANONICAL_PRIVATE_SYNCHRONOUS, G_VARIANT_TYPE_STRING);
+
+  if(value != NULL) {
+    gboolean is_private = is_private_hint(g_variant_get_string(value, NULL));
+    g_variant_unref(value);
+
+    if(is_private) {
+      g_variant_unref(hints);
+      return NOTIFICATION_VERDICT_PRIVATE;
+    }
+  }
+
+  g_variant_get_child(body, COLUMN_SUMMARY, "&s", &text);
+  blank = is_blank(text);
+
+  if(blank) {
+    g_variant_get_child(body, COLUMN_BODY, "&s", &text);
+    blank = is_blank(text);
+  }
+
+  if(blank) {
+    g_variant_unref(hints);
+    return NOTIFICATION_VERDICT_EMPTY;
+  }
+
+  NotificationVerdict verdict = NOTIFICATION_VERDICT_ACCEPT;
+
+  if(rules != NULL) {
+    guint fields = rule_set_get_fields(rules);
+    RuleInput input = { { NULL } };
+
+    if(fields & RULE_FIELD_MASK(RULE_FIELD_APP))
+      g_variant_get_child(body, COLUMN_APP_NAME, "&s", &input.fields[RULE_FIELD_APP]);
+    if(fields & RULE_FIELD_MASK(RULE_FIELD_SUMMARY))
+      g_variant_get_child(body, COLUMN_SUMMARY, "&s", &input.fields[RULE_FIELD_SUMMARY]);
+    if(fields & RULE_FIELD_MASK(RULE_FIELD_BODY))
+      g_variant_get_child(body, COLUMN_BODY, "&s", &input.fields[RULE_FIELD_BODY]);
+    if(fields & RULE_FIELD_MASK(RULE_FIELD_SENDER))
+      input.fields[RULE_FIELD_SENDER] = g_dbus_message_get_sender(message);
+
+    if(fields & RULE_FIELD_MASK(RULE_FIELD_URGENCY)) {
+      guint8 urgency = NOTIFICATION_URGENCY_NORMAL;
+
+      value = g_variant_lookup_value(hints, URGENCY_HINT, G_VARIANT_TYPE_BYTE);
+      if(value != NULL) {
+        urgency = MIN(g_variant_get_byte(value), NOTIFICATION_URGENCY_CRITICAL);
+        g_variant_unref(value);
+      }
+
+      input.fields[RULE_FIELD_URGENCY] = urgency_names[urgency];
+    }
+
+    if(rule_set_match(rules, &input))
+      verdict = NOTIFICATION_VERDICT_FILTERED;
+  }
+
+  g_variant_unref(hints);
+
+  return verdict;
+}
+
 const gchar*
 notification_get_app_name(Notification *self)
 {
@@ -172,15 +286,43 @@ notification_get_app_icon(Notification *self)
   return self->priv->app_icon;
 }
 
+guint32
+notification_get_replaces_id(Notification *self)
+{
+  return self->priv->replaces_id;
+}
+
+/**
+ * notification_get_summary:
+ * @self: the notification
+ * @length: (out) (optional): the length of the trimmed summary
+ *
+ * Returns the summary without surrounding whitespace. The string is not
+ * terminated after @length bytes.
+ **/
 const gchar*
-notification_get_summary(Notification *self)
+notification_get_summary(Notification *self, gsize *length)
 {
+  if(length != NULL)
+    *length = self->priv->summary_length;
+
   return self->priv->summary;
 }
 
+/**
+ * notification_get_body:
+ * @self: the notification
+ * @length: (out) (optional): the length of the trimmed body
+ *
+ * Returns the body without surrounding whitespace. The string is not
+ * terminated after @length bytes.
+ **/
 const gchar*
-notification_get_body(Notification *self)
+notification_get_body(Notification *self, gsize *length)
 {
+  if(length != NULL)
+    *length = self->priv->body_length;
+
   return self->priv->body;
 }
 
@@ -202,6 +344,12 @@ notification_is_private(Notification *self)
   return self->priv->is_private;
 }
 
+NotificationUrgency
+notification_get_urgency(Notification *self)
+{
+  return self->priv->urgency;
+}
+
 /**
  * A notification is considered empty if both the summary and body do not
  * contain any text.
@@ -212,11 +360,37 @@ notification_is_empty(Notification *self)
   return (self->priv->summary_length == 0) && (self->priv->body_length == 0);
 }
 
+/**
+ * notification_get_id:
+ * @self: the notification
+ *
+ * Returns the id set with notification_set_id(), or 0.
+ **/
+guint64
+notification_get_id(Notification *self)
+{
+  return self->priv->id;
+}
+
+/**
+ * notification_set_id:
+ * @self: the notification
+ * @id: an id meaningful to the caller
+ *
+ * Remembers where the notification was stored, so that later events about
+ * it can find the stored copy.
+ **/
+void
+notification_set_id(Notification *self, guint64 id)
+{
+  self->priv->id = id;
+}
+
 void
 notification_print(Notification *self)
 {
   g_print("app_name = %s\n", self->priv->app_name);
   g_print("app_icon = %s\n", self->priv->app_icon);
-  g_print("summary = %s\n", self->priv->summary);
-  g_print("body = %s\n", self->priv->body);
+  g_print("summary = %.*s\n", (int) self->priv->summary_length, self->priv->summary);
+  g_print("body = %.*s\n", (int) self->priv->body_length, self->priv->body);
 }
@@ -9,6 +9,7 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 #include <time.h>
+#include "rules.h"
 
 G_BEGIN_DECLS
 
@@ -18,6 +19,21 @@ G_BEGIN_DECLS
 #define IS_NOTIFICATION(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), NOTIFICATION_TYPE))
 #define IS_NOTIFICATION_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), NOTIFICATION_TYPE))
 
+typedef enum {
+  NOTIFICATION_VERDICT_ACCEPT,
+  NOTIFICATION_VERDICT_PRIVATE,
+  NOTIFICATION_VERDICT_EMPTY,
+  NOTIFICATION_VERDICT_FILTERED,
+  NOTIFICATION_VERDICT_MALFORMED
+} NotificationVerdict;
+
+/* the urgency hint of the notification spec */
+typedef enum {
+  NOTIFICATION_URGENCY_LOW,
+  NOTIFICATION_URGENCY_NORMAL,
+  NOTIFICATION_URGENCY_CRITICAL
+} NotificationUrgency;
+
 typedef struct _Notification        Notification;
 typedef struct _NotificationClass   NotificationClass;
 typedef struct _NotificationPrivate NotificationPrivate;
@@ -34,32 +50,40 @@ struct _NotificationClass
 };
 
 struct _NotificationPrivate {
-  gchar     *app_name;
-  gsize      app_name_length;
-  guint32    replaces_id;
-  gchar     *app_icon;
-  gsize      app_icon_length;
-  gchar     *summary;
-  gsize      summary_length;
-  gchar     *body;
-  gsize      body_length;
-  gint       expire_timeout;
-  GDateTime *timestamp;
+  GVariant    *message_body;
+  const gchar *app_name;
+  guint32      replaces_id;
+  const gchar *app_icon;
+  const gchar *summary;
+  gsize        summary_length;
+  const gchar *body;
+  gsize        body_length;
+  gint         expire_timeout;
+  GDateTime   *timestamp;
+
+  gboolean     is_private;
+  guint8       urgency;
 
-  gboolean   is_private;
+  /* set by whoever keeps the notification */
+  guint64      id;
 };
 
 GType         notification_get_type(void);
 Notification *notification_new(void);
 Notification *notification_new_from_dbus_message(GDBusMessage *);
+NotificationVerdict notification_prefilter(GDBusMessage *, RuleSet *);
 const gchar  *notification_get_app_name(Notification *);
 const gchar  *notification_get_app_icon(Notification *);
-const gchar  *notification_get_summary(Notification *);
-const gchar  *notification_get_body(Notification *);
+guint32       notification_get_replaces_id(Notification *);
+const gchar  *notification_get_summary(Notification *, gsize *);
+const gchar  *notification_get_body(Notification *, gsize *);
 gint64        notification_get_timestamp(Notification *);
 gchar        *notification_timestamp_for_locale(Notification *);
 gboolean      notification_is_private(Notification *);
+NotificationUrgency notification_get_urgency(Notification *);
 gboolean      notification_is_empty(Notification *);
+guint64       notification_get_id(Notification *);
+void          notification_set_id(Notification *, guint64);
 void          notification_print(Notification *);
 
 G_END_DECLS
@@ -0,0 +1,224 @@
+/*
+ * rate-limiter.c - Per-application token buckets for incoming notifications.
+ *
+ * Every application gets a bucket of `burst` tokens that refills at
+ * `per_minute` tokens a minute, and each notification takes one. Buckets are
+ * keyed by a copy of the application name. Any client can make up names, so
+ * once there are many buckets the ones that tell nothing are pruned: full
+ * ones, or ones unused for an hour, that have no overflow shown. A pruned
+ * application starts over with a full bucket, which is where it was anyway,
+ * and its dropped count goes with it.
+ *
+ * While an application is over its limit, the notifications it sends are
+ * counted as its overflow. The caller shows the overflow as a single entry
+ * and remembers that entry's id here; both are forgotten as soon as the
+ * application is admitted again.
+ */
+
+#include "rate-limiter.h"
+
+typedef struct {
+  gdouble tokens;
+  gint64  refilled;
+  guint   overflow;
+  guint64 overflow_id;
+  guint   dropped;
+} Bucket;
+
+/* buckets kept before pruning is tried, and how long an unused one lasts */
+#define PRUNE_SIZE 256
+#define PRUNE_IDLE (G_USEC_PER_SEC * (gint64) 3600)
+
+struct _RateLimiter
+{
+  guint       burst;
+  gdouble     per_usec;
+  GHashTable *buckets;
+  /* the size at which the next pruning happens */
+  guint       prune_at;
+};
+
+static void
+bucket_free(Bucket *bucket)
+{
+  g_slice_free(Bucket, bucket);
+}
+
+/**
+ * rate_limiter_new:
+ * @burst: how many notifications an application may send at once, 0 for no limit
+ * @per_minute: how many more it may send each minute
+ *
+ * Creates a limiter with no buckets.
+ **/
+RateLimiter*
+rate_limiter_new(guint burst, guint per_minute)
+{
+  RateLimiter *limiter = g_new0(RateLimiter, 1);
+
+  limiter->buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) bucket_free);
+  limiter->prune_at = PRUNE_SIZE;
+  rate_limiter_set_limits(limiter, burst, per_minute);
+
+  return limiter;
+}
+
+void
+rate_limiter_free(RateLimiter *limiter)
+{
+  g_hash_table_destroy(limiter->buckets);
+  g_free(limiter);
+}
+
+/**
+ * rate_limiter_set_limits:
+ * @limiter: the limiter
+ * @burst: how many notifications an application may send at once, 0 for no limit
+ * @per_minute: how many more it may send each minute
+ *
+ * Changes the limits. Buckets keep their tokens, up to the new burst.
+ **/
+void
+rate_limiter_set_limits(RateLimiter *limiter, guint burst, guint per_minute)
+{
+  limiter->burst = burst;
+  limiter->per_usec = per_minute / (60.0 * G_USEC_PER_SEC);
+}
+
+static Bucket*
+lookup(RateLimiter *limiter, const gchar *app_name)
+{
+  return g_hash_table_lookup(limiter->buckets, app_name);
+}
+
+/* drops the buckets that are full or long unused and show no overflow */
+static void
+prune(RateLimiter *limiter, gint64 now)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init(&iter, limiter->buckets);
+
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    Bucket *bucket = value;
+    gdouble tokens = bucket->tokens + (now - bucket->refilled) * limiter->per_usec;
+
+    if (bucket->overflow == 0 && (tokens >= limiter->burst || now - bucket->refilled > PRUNE_IDLE))
+      g_hash_table_iter_remove(&iter);
+  }
+
+  /* when most buckets are busy, wait for as many new ones again */
+  limiter->prune_at = MAX(PRUNE_SIZE, g_hash_table_size(limiter->buckets) * 2);
+}
+
+/**
+ * rate_limiter_admit:
+ * @limiter: the limiter
+ * @app_name: the application sending a notification
+ * @now: the monotonic time in microseconds
+ *
+ * Takes a token from the application's bucket. Returns FALSE and counts the
+ * notification as overflow if the bucket is empty.
+ **/
+gboolean
+rate_limiter_admit(RateLimiter *limiter, const gchar *app_name, gint64 now)
+{
+  if (limiter->burst == 0)
+    return TRUE;
+
+  Bucket *bucket = g_hash_table_lookup(limiter->buckets, app_name);
+
+  if (bucket == NULL) {
+    if (g_hash_table_size(limiter->buckets) >= limiter->prune_at)
+      prune(limiter, now);
+
+    bucket = g_slice_new0(Bucket);
+    bucket->tokens = limiter->burst;
+    bucket->refilled = now;
+    g_hash_table_insert(limiter->buckets, g_strdup(app_name), bucket);
+  }
+
+  bucket->tokens = MIN(bucket->tokens + (now - bucket->refilled) * limiter->per_usec, (gdouble) limiter->burst);
+  bucket->refilled = now;
+
+  if (bucket->tokens >= 1.0) {
+    bucket->tokens -= 1.0;
+    bucket->overflow = 0;
+    bucket->overflow_id = 0;
+    return TRUE;
+  }
+
+  bucket->overflow++;
+  bucket->dropped++;
+
+  return FALSE;
+}
+
+/**
+ * rate_limiter_get_overflow:
+ * @limiter: the limiter
+ * @app_name: an application
+ *
+ * Returns how many notifications the application sent since it last got
+ * over its limit.
+ **/
+guint
+rate_limiter_get_overflow(RateLimiter *limiter, const gchar *app_name)
+{
+  Bucket *bucket = lookup(limiter, app_name);
+
+  return bucket != NULL ? bucket->overflow : 0;
+}
+
+guint64
+rate_limiter_get_overflow_id(RateLimiter *limiter, const gchar *app_name)
+{
+  Bucket *bucket = lookup(limiter, app_name);
+
+  return bucket != NULL ? bucket->overflow_id : 0;
+}
+
+/**
+ * rate_limiter_set_overflow_id:
+ * @limiter: the limiter
+ * @app_name: an application with overflow
+ * @id: the id of the entry showing the overflow
+ *
+ * Remembers where the current overflow of an application is shown.
+ **/
+void
+rate_limiter_set_overflow_id(RateLimiter *limiter, const gchar *app_name, guint64 id)
+{
+  Bucket *bucket = lookup(limiter, app_name);
+
+  g_return_if_fail(bucket != NULL);
+
+  bucket->overflow_id = id;
+}
+
+/**
+ * rate_limiter_foreach:
+ * @limiter: the limiter
+ * @func: called for each application that went over its limit
+ * @user_data: passed to @func
+ *
+ * Lists how many notifications each application sent over its limit, for
+ * the applications that still have a bucket.
+ **/
+void
+rate_limiter_foreach(RateLimiter *limiter, RateLimiterFunc func, gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+
+  g_hash_table_iter_init(&iter, limiter->buckets);
+
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    Bucket *bucket = value;
+
+    if (bucket->dropped > 0)
+      func(key, bucket->dropped, user_data);
+  }
+}
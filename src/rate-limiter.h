@@ -0,0 +1,27 @@
+/*
+ * rate-limiter.h - Per-application token buckets for incoming notifications.
+ */
+
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RateLimiter RateLimiter;
+
+typedef void (*RateLimiterFunc)(const gchar *app_name, guint dropped, gpointer user_data);
+
+RateLimiter *rate_limiter_new(guint burst, guint per_minute);
+void         rate_limiter_free(RateLimiter *limiter);
+void         rate_limiter_set_limits(RateLimiter *limiter, guint burst, guint per_minute);
+gboolean     rate_limiter_admit(RateLimiter *limiter, const gchar *app_name, gint64 now);
+guint        rate_limiter_get_overflow(RateLimiter *limiter, const gchar *app_name);
+guint64      rate_limiter_get_overflow_id(RateLimiter *limiter, const gchar *app_name);
+void         rate_limiter_set_overflow_id(RateLimiter *limiter, const gchar *app_name, guint64 id);
+void         rate_limiter_foreach(RateLimiter *limiter, RateLimiterFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __RATE_LIMITER_H__ */
@@ -0,0 +1,379 @@
+/*
+ * rules.c - Compiled filter rules for incoming notifications.
+ *
+ * A rule is a list of "field=pattern" terms separated by ';', and matches a
+ * notification when all of its terms do, for example
+ *
+ *   app=evolution-alarm-notify;summary=Reminder*
+ *
+ * The fields are app, summary, body, urgency (low, normal or critical) and
+ * sender (the unique bus name). A pattern with '*' or '?' in it is a glob,
+ * anything else has to match exactly.
+ *
+ * Most rules name one application, so the set dispatches on the application
+ * name first: rules with a literal app term are filed under that name in a
+ * hash table and only those are looked at for a notification from it. The
+ * remaining rules are tried one by one. Plain application names, as found in
+ * the filter-list setting, drop everything from that application without
+ * looking at any rule.
+ *
+ * A set is immutable once built and can be shared with the GDBus worker
+ * thread. Building one reuses the compiled rules of the previous set, so a
+ * change to the settings only parses the rules that actually changed.
+ */
+
+#include <string.h>
+#include "rules.h"
+
+static const gchar *field_names[RULE_N_FIELDS] = {
+  "app",
+  "summary",
+  "body",
+  "urgency",
+  "sender"
+};
+
+typedef struct {
+  RuleField     field;
+  gchar        *literal;
+  GPatternSpec *glob;
+} Term;
+
+typedef struct {
+  gint   ref_count;
+  gchar *app;
+  guint  fields;
+  guint  n_terms;
+  Term  *terms;
+} Rule;
+
+typedef struct {
+  /* everything from this application is dropped */
+  gboolean   all;
+  GPtrArray *rules;
+} Bucket;
+
+struct _RuleSet
+{
+  gint        ref_count;
+  GHashTable *by_app;
+  GPtrArray  *wildcard;
+  /* rule text to compiled rule, for the next set to reuse */
+  GHashTable *compiled;
+  guint       fields;
+  guint       size;
+};
+
+static Rule*
+rule_ref(Rule *rule)
+{
+  g_atomic_int_inc(&rule->ref_count);
+
+  return rule;
+}
+
+static void
+rule_unref(gpointer data)
+{
+  Rule *rule = data;
+  guint i;
+
+  if (!g_atomic_int_dec_and_test(&rule->ref_count))
+    return;
+
+  for (i = 0; i < rule->n_terms; i++) {
+    g_free(rule->terms[i].literal);
+    if (rule->terms[i].glob != NULL)
+      g_pattern_spec_free(rule->terms[i].glob);
+  }
+
+  g_free(rule->terms);
+  g_free(rule->app);
+  g_free(rule);
+}
+
+static gboolean
+parse_field(const gchar *name, RuleField *field)
+{
+  guint i;
+
+  for (i = 0; i < RULE_N_FIELDS; i++) {
+    if (g_str_equal(name, field_names[i])) {
+      *field = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static Rule*
+rule_parse(const gchar *text)
+{
+  gchar **parts = g_strsplit(text, ";", -1);
+  Rule *rule = g_new0(Rule, 1);
+  guint n_parts = g_strv_length(parts);
+  guint i;
+
+  rule->ref_count = 1;
+  rule->terms = g_new0(Term, n_parts);
+
+  for (i = 0; i < n_parts; i++) {
+    gchar *term = g_strstrip(parts[i]);
+    gchar *pattern = strchr(term, '=');
+    RuleField field;
+
+    if (*term == '\0')
+      continue;
+
+    if (pattern == NULL) {
+      g_warning("Ignoring filter rule \"%s\": \"%s\" is not field=pattern", text, term);
+      goto invalid;
+    }
+
+    *pattern++ = '\0';
+    g_strchomp(term);
+    pattern = g_strchug(pattern);
+
+    if (!parse_field(term, &field)) {
+      g_warning("Ignoring filter rule \"%s\": unknown field \"%s\"", text, term);
+      goto invalid;
+    }
+
+    gboolean is_glob = strpbrk(pattern, "*?") != NULL;
+
+    /* the first literal application name is matched by the dispatch table */
+    if (field == RULE_FIELD_APP && !is_glob && rule->app == NULL) {
+      rule->app = g_strdup(pattern);
+      rule->fields |= RULE_FIELD_MASK(field);
+      continue;
+    }
+
+    Term *t = &rule->terms[rule->n_terms++];
+
+    t->field = field;
+    if (is_glob)
+      t->glob = g_pattern_spec_new(pattern);
+    else
+      t->literal = g_strdup(pattern);
+    rule->fields |= RULE_FIELD_MASK(field);
+  }
+
+  g_strfreev(parts);
+
+  if (rule->app == NULL && rule->n_terms == 0) {
+    rule_unref(rule);
+    return NULL;
+  }
+
+  return rule;
+
+invalid:
+  g_strfreev(parts);
+  rule_unref(rule);
+
+  return NULL;
+}
+
+static gboolean
+term_matches(const Term *term, const gchar *value)
+{
+  if (value == NULL)
+    return FALSE;
+
+  if (term->glob == NULL)
+    return strcmp(term->literal, value) == 0;
+
+#if GLIB_CHECK_VERSION(2, 70, 0)
+  return g_pattern_spec_match_string(term->glob, value);
+#else
+  return g_pattern_match_string(term->glob, value);
+#endif
+}
+
+static gboolean
+rule_matches(const Rule *rule, const RuleInput *input)
+{
+  guint i;
+
+  for (i = 0; i < rule->n_terms; i++) {
+    if (!term_matches(&rule->terms[i], input->fields[rule->terms[i].field]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+any_matches(GPtrArray *rules, const RuleInput *input)
+{
+  guint i;
+
+  if (rules == NULL)
+    return FALSE;
+
+  for (i = 0; i < rules->len; i++) {
+    if (rule_matches(g_ptr_array_index(rules, i), input))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+bucket_free(gpointer data)
+{
+  Bucket *bucket = data;
+
+  if (bucket->rules != NULL)
+    g_ptr_array_unref(bucket->rules);
+  g_slice_free(Bucket, bucket);
+}
+
+static Bucket*
+bucket_for(RuleSet *set, const gchar *app_name)
+{
+  Bucket *bucket = g_hash_table_lookup(set->by_app, app_name);
+
+  if (bucket == NULL) {
+    bucket = g_slice_new0(Bucket);
+    g_hash_table_insert(set->by_app, g_strdup(app_name), bucket);
+  }
+
+  return bucket;
+}
+
+static void
+add_rule(RuleSet *set, Rule *rule)
+{
+  if (rule->app == NULL) {
+    g_ptr_array_add(set->wildcard, rule_ref(rule));
+  } else {
+    Bucket *bucket = bucket_for(set, rule->app);
+
+    if (rule->n_terms == 0) {
+      bucket->all = TRUE;
+    } else {
+      if (bucket->rules == NULL)
+        bucket->rules = g_ptr_array_new_with_free_func(rule_unref);
+      g_ptr_array_add(bucket->rules, rule_ref(rule));
+    }
+  }
+
+  set->fields |= rule->fields;
+  set->size++;
+}
+
+/**
+ * rule_set_new:
+ * @app_names: (nullable): applications to drop everything from
+ * @rules: (nullable): rules in the format described above
+ * @previous: (nullable): a set to take already compiled rules from
+ *
+ * Compiles a rule set. Rules that cannot be parsed are skipped with a
+ * warning, rules that are also in @previous are not parsed again.
+ **/
+RuleSet*
+rule_set_new(const gchar * const *app_names, const gchar * const *rules, RuleSet *previous)
+{
+  RuleSet *set = g_new0(RuleSet, 1);
+  guint i;
+
+  set->ref_count = 1;
+  set->by_app = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, bucket_free);
+  set->wildcard = g_ptr_array_new_with_free_func(rule_unref);
+  set->compiled = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, rule_unref);
+
+  for (i = 0; app_names != NULL && app_names[i] != NULL; i++) {
+    bucket_for(set, app_names[i])->all = TRUE;
+    set->fields |= RULE_FIELD_MASK(RULE_FIELD_APP);
+    set->size++;
+  }
+
+  for (i = 0; rules != NULL && rules[i] != NULL; i++) {
+    Rule *rule = NULL;
+
+    if (g_hash_table_contains(set->compiled, rules[i]))
+      continue;
+
+    if (previous != NULL)
+      rule = g_hash_table_lookup(previous->compiled, rules[i]);
+
+    if (rule != NULL)
+      rule_ref(rule);
+    else
+      rule = rule_parse(rules[i]);
+
+    if (rule == NULL)
+      continue;
+
+    g_hash_table_insert(set->compiled, g_strdup(rules[i]), rule);
+    add_rule(set, rule);
+  }
+
+  return set;
+}
+
+RuleSet*
+rule_set_ref(RuleSet *set)
+{
+  g_atomic_int_inc(&set->ref_count);
+
+  return set;
+}
+
+void
+rule_set_unref(RuleSet *set)
+{
+  if (!g_atomic_int_dec_and_test(&set->ref_count))
+    return;
+
+  g_hash_table_destroy(set->by_app);
+  g_ptr_array_unref(set->wildcard);
+  g_hash_table_destroy(set->compiled);
+  g_free(set);
+}
+
+/**
+ * rule_set_get_fields:
+ * @set: the rule set
+ *
+ * Returns the RULE_FIELD_MASK() of every field some rule looks at. The
+ * others need not be filled in for rule_set_match().
+ **/
+guint
+rule_set_get_fields(RuleSet *set)
+{
+  return set->fields;
+}
+
+/* the number of application names and distinct rules in the set */
+guint
+rule_set_get_size(RuleSet *set)
+{
+  return set->size;
+}
+
+/**
+ * rule_set_match:
+ * @set: the rule set
+ * @input: the fields of a notification
+ *
+ * Returns TRUE if any rule matches the notification. Only the rules filed
+ * under its application name and the ones without a literal application
+ * name are looked at.
+ **/
+gboolean
+rule_set_match(RuleSet *set, const RuleInput *input)
+{
+  const gchar *app_name = input->fields[RULE_FIELD_APP];
+
+  if (app_name != NULL) {
+    Bucket *bucket = g_hash_table_lookup(set->by_app, app_name);
+
+    if (bucket != NULL && (bucket->all || any_matches(bucket->rules, input)))
+      return TRUE;
+  }
+
+  return set->wildcard->len > 0 && any_matches(set->wildcard, input);
+}
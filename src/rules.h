@@ -0,0 +1,39 @@
+/*
+ * rules.h - Compiled filter rules for incoming notifications.
+ */
+
+#ifndef __RULES_H__
+#define __RULES_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  RULE_FIELD_APP,
+  RULE_FIELD_SUMMARY,
+  RULE_FIELD_BODY,
+  RULE_FIELD_URGENCY,
+  RULE_FIELD_SENDER,
+  RULE_N_FIELDS
+} RuleField;
+
+/* the values a rule set looks at, NULL for a field the notification lacks */
+typedef struct {
+  const gchar *fields[RULE_N_FIELDS];
+} RuleInput;
+
+typedef struct _RuleSet RuleSet;
+
+RuleSet *rule_set_new(const gchar * const *app_names, const gchar * const *rules, RuleSet *previous);
+RuleSet *rule_set_ref(RuleSet *set);
+void     rule_set_unref(RuleSet *set);
+guint    rule_set_get_fields(RuleSet *set);
+guint    rule_set_get_size(RuleSet *set);
+gboolean rule_set_match(RuleSet *set, const RuleInput *input);
+
+#define RULE_FIELD_MASK(field) (1u << (field))
+
+G_END_DECLS
+
+#endif /* __RULES_H__ */
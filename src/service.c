@@ -18,25 +18,38 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 #include <ayatana/common/utils.h>
 #include "service.h"
 #include "dbus-spy.h"
+#include "history.h"
+#include "markup.h"
+#include "menu-section.h"
+#include "metrics.h"
+#include "notification-store.h"
+#include "rate-limiter.h"
+#include "rules.h"
 #include "urlregex.h"
+#include "stats.h"
 
 #define BUS_NAME "org.ayatana.indicator.notifications"
 #define BUS_PATH "/org/ayatana/indicator/notifications"
 #define HINT_MAX 10
+#define HINT_SAVE_DELAY 5
 
 static guint m_nSignal = 0;
 
 enum
 {
-    SECTION_HEADER = (1<<0),
-    SECTION_NOTIFICATIONS = (1<<1),
-    SECTION_DO_NOT_DISTURB = (1<<2),
-    SECTION_CLEAR = (1<<3)
+    PROP_0,
+    PROP_BUS_ADDRESS
+};
+
+enum
+{
+    SECTION_HEADER = (1<<0)
 };
 
 enum
@@ -52,6 +65,23 @@ static const char * const menu_names[N_PROFILES] =
     "desktop"
 };
 
+enum
+{
+    HEADER_READ,
+    HEADER_READ_DND,
+    HEADER_UNREAD,
+    HEADER_UNREAD_DND,
+    N_HEADER_STATES
+};
+
+static const char * const header_icons[N_HEADER_STATES] =
+{
+    "ayatana-indicator-notification-read",
+    "ayatana-indicator-notification-read-dnd",
+    "ayatana-indicator-notification-unread",
+    "ayatana-indicator-notification-unread-dnd"
+};
+
 struct ProfileMenuInfo
 {
     GMenu *pMenu;
@@ -63,26 +93,42 @@ struct _IndicatorNotificationsServicePrivate
 {
     GCancellable *pCancellable;
     GSettings *pSettings;
+    gchar *sBusAddress;
     guint nOwnId;
     guint nActionsId;
+    guint nMetricsId;
     GDBusConnection *pConnection;
-    gboolean bMenusBuilt;
     struct ProfileMenuInfo lMenus[N_PROFILES];
     GSimpleActionGroup *pActionGroup;
     GSimpleAction *pHeaderAction;
     GSimpleAction *pClearAction;
     GSimpleAction *pRemoveAction;
     GSimpleAction *pDoNotDisturbAction;
-    GList *lVisibleItems;
-    GList *lHiddenItems;
+    NotificationStore *pStore;
+    guint nVisibleItems;
+    guint nLastVisible;
+    guint nPending;
+    gint nFrameInterval;
+    guint nFrameId;
     gboolean bDoNotDisturb;
     gboolean bHasUnread;
     gint nMaxItems;
     DBusSpy *pBusSpy;
-    GHashTable *lFilters;
-    GList *lHints;
-    GMenu *pNotificationsSection;
+    // Most recent first, and an index into it by application name
+    GQueue lHints;
+    GHashTable *lHintLinks;
+    guint nSaveHintsId;
+    MenuSection *pNotificationsSection;
+    GMenu *pDoNotDisturbSection;
+    GHashTable *lServerIds;
+    GHashTable *lContents;
+    gint nDedupWindow;
+    RateLimiter *pRateLimiter;
+    RuleSet *pRules;
+    History *pHistory;
     gboolean bHasDoNotDisturb;
+    GVariant *lHeaderStates[N_HEADER_STATES];
+    guint nHeaderState;
 };
 
 typedef IndicatorNotificationsServicePrivate priv_t;
@@ -91,6 +137,8 @@ G_DEFINE_TYPE_WITH_PRIVATE(IndicatorNotificationsService, indicator_notification
 
 static void rebuildNow(IndicatorNotificationsService *self, guint nSections);
 static void updateFilters(IndicatorNotificationsService *self);
+static void updateHistory(IndicatorNotificationsService *self);
+static void updateQueueLimit(IndicatorNotificationsService *self);
 
 static void saveHints(IndicatorNotificationsService *self)
 {
@@ -98,7 +146,7 @@ static void saveHints(IndicatorNotificationsService *self)
     int i = 0;
     GList *l;
 
-    for (l = self->priv->lHints; (l != NULL) && (i < HINT_MAX); l = l->next, i++)
+    for (l = self->priv->lHints.head; (l != NULL) && (i < HINT_MAX); l = l->next, i++)
     {
         hints[i] = (gchar *) l->data;
     }
@@ -108,162 +156,646 @@ static void saveHints(IndicatorNotificationsService *self)
     g_settings_set_strv(self->priv->pSettings, "filter-list-hints", (const gchar **) hints);
 }
 
+static gboolean onSaveHints(gpointer user_data)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+
+    self->priv->nSaveHintsId = 0;
+    saveHints(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+// Writes the hints once no application name came up for a while, so a burst of new applications costs one write
+static void scheduleSaveHints(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+
+    if (p->nSaveHintsId != 0)
+    {
+        g_source_remove(p->nSaveHintsId);
+    }
+
+    p->nSaveHintsId = g_timeout_add_seconds(HINT_SAVE_DELAY, onSaveHints, self);
+}
+
 static void updateHints(IndicatorNotificationsService *self, Notification *notification)
 {
     g_return_if_fail(IS_NOTIFICATION(notification));
 
+    priv_t *p = self->priv;
+
+    // The settings belong to the user running the service, not to the users of other buses
+    if (p->sBusAddress != NULL)
+    {
+        return;
+    }
+
     const gchar *appname = notification_get_app_name(notification);
+    GList *link = g_hash_table_lookup(p->lHintLinks, appname);
 
-    // Avoid duplicates
-    GList *l;
-    for (l = self->priv->lHints; l != NULL; l = l->next)
+    if (link == p->lHints.head && link != NULL)
     {
-        if (g_strcmp0(appname, (const gchar *) l->data) == 0)
+        return;
+    }
+
+    // Known names move to the front, new ones push out the least recent
+    if (link != NULL)
+    {
+        g_queue_unlink(&p->lHints, link);
+    }
+    else
+    {
+        link = g_list_alloc();
+        link->data = g_strdup(appname);
+        g_hash_table_insert(p->lHintLinks, link->data, link);
+
+        if (p->lHints.length == HINT_MAX)
         {
-            return;
+            GList *last = g_queue_pop_tail_link(&p->lHints);
+            g_hash_table_remove(p->lHintLinks, last->data);
+            g_free(last->data);
+            g_list_free_1(last);
         }
     }
 
-    // Add the appname
-    self->priv->lHints = g_list_prepend(self->priv->lHints, g_strdup(appname));
+    g_queue_push_head_link(&p->lHints, link);
+    scheduleSaveHints(self);
+}
+
+static void updateClearItem(IndicatorNotificationsService *self)
+{
+    g_simple_action_set_enabled(self->priv->pClearAction, notification_store_get_length(self->priv->pStore) != 0);
+}
+
+static void setUnread(IndicatorNotificationsService *self, gboolean unread)
+{
+    self->priv->bHasUnread = unread;
+    rebuildNow(self, SECTION_HEADER);
+}
+
+static void fillHistoryEntry(HistoryEntry *pEntry, Notification *note, guint64 nId)
+{
+    pEntry->id = nId;
+    pEntry->timestamp = notification_get_timestamp(note);
+    pEntry->app_name = notification_get_app_name(note);
+    pEntry->app_name_length = strlen(pEntry->app_name);
+    pEntry->summary = notification_get_summary(note, &pEntry->summary_length);
+    pEntry->body = notification_get_body(note, &pEntry->body_length);
+}
+
+static GHashTable *renderItem(const HistoryEntry *pEntry, guint nCount)
+{
+    gint64 nStart = stats_stage_begin();
+    gchar *markup = markup_render_label(pEntry, nCount, _("from"));
+    GHashTable *item = menu_section_item_new(markup, "indicator.remove-notification", g_variant_new_int64((gint64) pEntry->id));
+    g_free(markup);
+    menu_section_item_set_attribute(item, "x-ayatana-timestamp", g_variant_new_int64(pEntry->timestamp));
+    menu_section_item_set_attribute(item, "x-ayatana-use-markup", g_variant_new_boolean(TRUE));
+    menu_section_item_set_attribute(item, "x-ayatana-type", g_variant_new_string("org.ayatana.indicator.removable"));
+    stats_stage_end(STATS_STAGE_MARKUP, nStart);
+
+    return item;
+}
+
+static void forgetContent(IndicatorNotificationsService *self, guint nSlot)
+{
+    guint32 nHash = notification_store_get(self->priv->pStore, nSlot)->hash;
+    gpointer pSlot;
+
+    // Only the newest record with some text is looked up
+    if (g_hash_table_lookup_extended(self->priv->lContents, GUINT_TO_POINTER(nHash), NULL, &pSlot) && GPOINTER_TO_UINT(pSlot) == nSlot)
+    {
+        g_hash_table_remove(self->priv->lContents, GUINT_TO_POINTER(nHash));
+    }
+}
+
+static void setRecordText(IndicatorNotificationsService *self, guint nSlot, const HistoryEntry *pEntry)
+{
+    forgetContent(self, nSlot);
+    notification_store_set_text(self->priv->pStore, nSlot, pEntry->app_name, pEntry->app_name_length, pEntry->summary, pEntry->summary_length, pEntry->body, pEntry->body_length);
+    g_hash_table_insert(self->priv->lContents, GUINT_TO_POINTER(notification_store_get(self->priv->pStore, nSlot)->hash), GUINT_TO_POINTER(nSlot));
+}
 
-    // Keep only a reasonable number
-    while (g_list_length(self->priv->lHints) > HINT_MAX)
+// Records only keep their text, the menu item is built when the record is shown
+static GHashTable *renderRecord(IndicatorNotificationsService *self, guint nSlot)
+{
+    NotificationRecord *pRecord = notification_store_get(self->priv->pStore, nSlot);
+    HistoryEntry entry;
+
+    entry.id = pRecord->id;
+    entry.timestamp = pRecord->timestamp;
+    entry.app_name = pRecord->text;
+    entry.app_name_length = pRecord->app_name_length;
+    entry.summary = entry.app_name + entry.app_name_length + 1;
+    entry.summary_length = pRecord->summary_length;
+    entry.body = entry.summary + entry.summary_length + 1;
+    entry.body_length = pRecord->body_length;
+
+    return renderItem(&entry, pRecord->count);
+}
+
+// Removes the nCount oldest items from the menu with a single change
+static void hideOldestVisible(IndicatorNotificationsService *self, guint nCount)
+{
+    priv_t *p = self->priv;
+    guint i;
+
+    if (nCount == 0)
+    {
+        return;
+    }
+
+    menu_section_splice(p->pNotificationsSection, p->nVisibleItems - nCount, nCount, NULL, 0);
+
+    for (i = 0; i < nCount; i++)
     {
-        GList *last = g_list_last(self->priv->lHints);
-        g_free(last->data);
-        self->priv->lHints = g_list_delete_link(self->priv->lHints, last);
+        p->nLastVisible = notification_store_newer(p->pStore, p->nLastVisible);
     }
 
-    // Save the hints
-    saveHints(self);
+    p->nVisibleItems -= nCount;
 }
 
-static gchar *createMarkup(const gchar *body)
+static void forgetRecord(IndicatorNotificationsService *self, guint nSlot)
 {
-    GList *list = urlregex_split_all(body);
-    guint len = g_list_length(list);
-    gchar **str_array = g_new0(gchar *, len + 1);
-    guint i = 0;
-    GList *item;
-    gchar *escaped_text;
-    gchar *escaped_expanded;
+    priv_t *p = self->priv;
+    guint32 nServerId = notification_store_get(p->pStore, nSlot)->server_id;
 
-    for (item = list; item; item = item->next, i++)
+    if (nServerId != 0)
     {
-        MatchGroup *group = (MatchGroup *)item->data;
+        g_hash_table_remove(p->lServerIds, GUINT_TO_POINTER(nServerId));
+    }
 
-        if (group->type == MATCHED)
-        {
-            escaped_text = g_markup_escape_text(group->text, -1);
-            escaped_expanded = g_markup_escape_text(group->expanded, -1);
-            str_array[i] = g_strdup_printf("<a href=\"%s\">%s</a>", escaped_expanded, escaped_text);
-            g_free(escaped_text);
-            g_free(escaped_expanded);
-        }
-        else
+    forgetContent(self, nSlot);
+    notification_store_remove(p->pStore, nSlot);
+}
+
+static void forgetOldest(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+    guint nSlot = notification_store_oldest(p->pStore);
+
+    // A burst larger than the history pushes out records that were never shown
+    if (notification_store_get_length(p->pStore) <= p->nPending)
+    {
+        p->nPending--;
+    }
+    // Only happens when the whole history fits in the menu
+    else if (nSlot == p->nLastVisible)
+    {
+        hideOldestVisible(self, 1);
+    }
+
+    forgetRecord(self, nSlot);
+}
+
+/*
+ * Returns the menu position of a record, or nVisibleItems if it is hidden.
+ * The nPending newest records are not in the menu yet. Only newer records
+ * are counted, so this never takes more than nPending + max-items steps.
+ */
+static guint getMenuPosition(IndicatorNotificationsService *self, guint nSlot, guint nPending)
+{
+    priv_t *p = self->priv;
+    guint nNewer = 0;
+    guint nLimit = nPending + p->nVisibleItems;
+    guint nNext = notification_store_newer(p->pStore, nSlot);
+
+    while (nNext != NOTIFICATION_STORE_NONE && nNewer < nLimit)
+    {
+        nNext = notification_store_newer(p->pStore, nNext);
+        nNewer++;
+    }
+
+    if (nNewer < nPending || nNewer >= nLimit)
+    {
+        return p->nVisibleItems;
+    }
+
+    return nNewer - nPending;
+}
+
+// Shows the new text of a record if it is in the menu, a hidden record is rendered when it is shown
+static void refreshRecord(IndicatorNotificationsService *self, guint nSlot, guint nPending)
+{
+    priv_t *p = self->priv;
+    guint nPosition = getMenuPosition(self, nSlot, nPending);
+
+    if (nPosition < p->nVisibleItems)
+    {
+        GHashTable *item = renderRecord(self, nSlot);
+        menu_section_replace(p->pNotificationsSection, nPosition, item);
+        g_hash_table_unref(item);
+    }
+}
+
+/*
+ * Updates the record a notification replaces, where it is. Returns FALSE if
+ * the replaced notification is unknown or forgotten.
+ */
+static gboolean replaceRecord(IndicatorNotificationsService *self, Notification *note, guint nPending)
+{
+    priv_t *p = self->priv;
+    gpointer pSlot;
+
+    if (!g_hash_table_lookup_extended(p->lServerIds, GUINT_TO_POINTER(notification_get_replaces_id(note)), NULL, &pSlot))
+    {
+        return FALSE;
+    }
+
+    guint nSlot = GPOINTER_TO_UINT(pSlot);
+    NotificationRecord *pRecord = notification_store_get(p->pStore, nSlot);
+    HistoryEntry entry;
+
+    updateHints(self, note);
+    fillHistoryEntry(&entry, note, pRecord->id);
+    setRecordText(self, nSlot, &entry);
+    pRecord->timestamp = entry.timestamp;
+    notification_set_id(note, pRecord->id);
+
+    if (p->pHistory != NULL)
+    {
+        history_update(p->pHistory, &entry);
+    }
+
+    refreshRecord(self, nSlot, nPending);
+
+    return TRUE;
+}
+
+/*
+ * Counts a notification that repeats a recent one with the same text on the
+ * existing record, without rendering anything for a hidden record. Returns
+ * FALSE if there is no such record.
+ */
+static gboolean repeatRecord(IndicatorNotificationsService *self, Notification *note, guint nPending)
+{
+    priv_t *p = self->priv;
+    HistoryEntry entry;
+    gpointer pSlot;
+
+    if (p->nDedupWindow <= 0)
+    {
+        return FALSE;
+    }
+
+    fillHistoryEntry(&entry, note, 0);
+
+    guint32 nHash = notification_store_hash_text(entry.app_name, entry.app_name_length, entry.summary, entry.summary_length, entry.body, entry.body_length);
+
+    if (!g_hash_table_lookup_extended(p->lContents, GUINT_TO_POINTER(nHash), NULL, &pSlot))
+    {
+        return FALSE;
+    }
+
+    guint nSlot = GPOINTER_TO_UINT(pSlot);
+    NotificationRecord *pRecord = notification_store_get(p->pStore, nSlot);
+
+    if (entry.timestamp - pRecord->timestamp > p->nDedupWindow || !notification_record_text_equal(pRecord, entry.app_name, entry.app_name_length, entry.summary, entry.summary_length, entry.body, entry.body_length))
+    {
+        return FALSE;
+    }
+
+    // The note remembers the record, so the server's id for the newest copy replaces it
+    pRecord->count++;
+    pRecord->timestamp = entry.timestamp;
+    notification_set_id(note, pRecord->id);
+
+    if (p->pHistory != NULL)
+    {
+        entry.id = pRecord->id;
+        history_update(p->pHistory, &entry);
+    }
+
+    refreshRecord(self, nSlot, nPending);
+
+    return TRUE;
+}
+
+/*
+ * Counts a notification from an application over its rate limit on the one
+ * record that stands for all of its overflow, which is not kept in the
+ * history. Returns TRUE if that record had to be added.
+ */
+static gboolean showOverflow(IndicatorNotificationsService *self, Notification *note, guint nPending)
+{
+    priv_t *p = self->priv;
+    const gchar *sAppName = notification_get_app_name(note);
+    guint nOverflow = rate_limiter_get_overflow(p->pRateLimiter, sAppName);
+    guint nSlot = notification_store_lookup(p->pStore, rate_limiter_get_overflow_id(p->pRateLimiter, sAppName));
+    gboolean bAdded = FALSE;
+
+    if (nSlot == NOTIFICATION_STORE_NONE)
+    {
+        if (notification_store_is_full(p->pStore))
         {
-            str_array[i] = g_markup_escape_text(group->text, -1);
+            forgetOldest(self);
         }
+
+        nSlot = notification_store_prepend(p->pStore);
+        rate_limiter_set_overflow_id(p->pRateLimiter, sAppName, notification_store_get(p->pStore, nSlot)->id);
+        bAdded = TRUE;
     }
 
-    urlregex_matchgroup_list_free(list);
-    gchar *result = g_strjoinv(NULL, str_array);
-    g_strfreev(str_array);
+    gchar *sSummary = g_strdup_printf(ngettext("%u more from %s", "%u more from %s", nOverflow), nOverflow, sAppName);
+    HistoryEntry entry;
+
+    fillHistoryEntry(&entry, note, notification_store_get(p->pStore, nSlot)->id);
+    entry.summary = sSummary;
+    entry.summary_length = strlen(sSummary);
+    entry.body = _("This application sent too many notifications at once.");
+    entry.body_length = strlen(entry.body);
+    setRecordText(self, nSlot, &entry);
+    notification_store_get(p->pStore, nSlot)->timestamp = entry.timestamp;
+    g_free(sSummary);
+
+    if (!bAdded)
+    {
+        refreshRecord(self, nSlot, nPending);
+    }
 
-    return result;
+    return bAdded;
 }
 
-static void updateClearItem(IndicatorNotificationsService *self)
+/*
+ * Puts the part of the nAdded newest records that is visible into the menu
+ * and hides what no longer fits, with at most two changes.
+ */
+static void showNewest(IndicatorNotificationsService *self, guint nAdded)
+{
+    priv_t *p = self->priv;
+    guint nInsert = MIN(nAdded, (guint) p->nMaxItems);
+    guint nSlot = notification_store_newest(p->pStore);
+    guint i;
+
+    if (nInsert == 0)
+    {
+        return;
+    }
+
+    // Trim first, a batch that fills the menu on its own pushes out everything that was visible
+    hideOldestVisible(self, p->nVisibleItems - MIN(p->nVisibleItems, (guint) p->nMaxItems - nInsert));
+
+    for (i = 1; i < nInsert; i++)
+    {
+        nSlot = notification_store_older(p->pStore, nSlot);
+    }
+
+    if (p->nVisibleItems == 0)
+    {
+        p->nLastVisible = nSlot;
+    }
+
+    GHashTable **lItems = g_newa(GHashTable *, nInsert);
+
+    // Only the records that end up in the menu get rendered
+    for (i = nInsert; i > 0; i--)
+    {
+        lItems[i - 1] = renderRecord(self, nSlot);
+        nSlot = notification_store_newer(p->pStore, nSlot);
+    }
+
+    menu_section_splice(p->pNotificationsSection, 0, 0, lItems, nInsert);
+
+    for (i = 0; i < nInsert; i++)
+    {
+        g_hash_table_unref(lItems[i]);
+    }
+
+    p->nVisibleItems += nInsert;
+}
+
+// Appends up to nCount hidden records to the end of the menu with a single change
+static void showOlder(IndicatorNotificationsService *self, guint nCount)
 {
-    guint visible_length = g_list_length(self->priv->lVisibleItems);
-    guint hidden_length = g_list_length(self->priv->lHiddenItems);
-    guint total_length = visible_length + hidden_length;
+    priv_t *p = self->priv;
+    guint nSlot = p->nVisibleItems > 0 ? notification_store_older(p->pStore, p->nLastVisible) : notification_store_newest(p->pStore);
+    GHashTable **lItems = g_newa(GHashTable *, MAX(nCount, 1));
+    guint n = 0;
+    guint i;
+
+    while (n < nCount && nSlot != NOTIFICATION_STORE_NONE)
+    {
+        lItems[n++] = renderRecord(self, nSlot);
+        p->nLastVisible = nSlot;
+        nSlot = notification_store_older(p->pStore, nSlot);
+    }
 
-    g_simple_action_set_enabled(self->priv->pClearAction, total_length != 0);
+    if (n == 0)
+    {
+        return;
+    }
+
+    menu_section_splice(p->pNotificationsSection, p->nVisibleItems, 0, lItems, n);
+
+    for (i = 0; i < n; i++)
+    {
+        g_hash_table_unref(lItems[i]);
+    }
+
+    p->nVisibleItems += n;
 }
 
-static void setUnread(IndicatorNotificationsService *self, gboolean unread)
+// Shows the records that came in since the last frame
+static void showPending(IndicatorNotificationsService *self)
 {
-    self->priv->bHasUnread = unread;
-    rebuildNow(self, SECTION_HEADER);
+    priv_t *p = self->priv;
+
+    if (p->nPending == 0)
+    {
+        return;
+    }
+
+    gint64 nStart = stats_stage_begin();
+    showNewest(self, p->nPending);
+    stats_stage_end(STATS_STAGE_MENU, nStart);
+    p->nPending = 0;
 }
 
-static void onMessageReceived(DBusSpy *pBusSpy, Notification *note, gpointer user_data)
+static gboolean onFrame(gpointer user_data)
 {
-    g_return_if_fail(IS_DBUS_SPY(pBusSpy));
-    g_return_if_fail(IS_NOTIFICATION(note));
     IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+    priv_t *p = self->priv;
 
-    // Discard useless notifications
-    if(notification_is_private(note) || notification_is_empty(note))
+    // The frame ends once a whole interval went by without new records
+    if (p->nPending == 0)
     {
-        g_object_unref(note);
+        p->nFrameId = 0;
 
-        return;
+        return G_SOURCE_REMOVE;
     }
 
-    // Discard notifications on the filter list
-    if(self->priv->lFilters != NULL && g_hash_table_contains(self->priv->lFilters, notification_get_app_name(note)))
+    showPending(self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Records that come in while a frame is running wait for its end, so a burst
+ * reaches the menu as one change per frame instead of one per notification.
+ * The first record of a burst and critical ones are shown right away.
+ */
+static void scheduleFrame(IndicatorNotificationsService *self, gboolean bUrgent)
+{
+    priv_t *p = self->priv;
+
+    if (bUrgent || p->nFrameInterval == 0)
     {
-        g_object_unref(note);
+        showPending(self);
 
         return;
     }
 
-    updateHints(self, note);
+    if (p->nFrameId == 0)
+    {
+        showPending(self);
+        p->nFrameId = g_timeout_add(p->nFrameInterval, onFrame, self);
+    }
+}
 
-    gchar *unescaped_timestamp_string = notification_timestamp_for_locale(note);
-    gchar *app_name = g_markup_escape_text(notification_get_app_name(note), -1);
-    gchar *summary = g_markup_escape_text(notification_get_summary(note), -1);
-    gchar *body = createMarkup(notification_get_body(note));
-    g_object_unref(note);
-    gchar *timestamp_string = g_markup_escape_text(unescaped_timestamp_string, -1);
-    gchar *markup = g_strdup_printf("<b>%s</b>\n%s\n<small><i>%s %s <b>%s</b></i></small>", summary, body, timestamp_string, _("from"), app_name);
-    g_free(app_name);
-    g_free(summary);
-    g_free(body);
-    g_free(unescaped_timestamp_string);
-    g_free(timestamp_string);
-    GMenuItem * item = g_menu_item_new(markup, NULL);
-    g_free(markup);
-    gint64 nTimestamp = notification_get_timestamp(note);
-    g_menu_item_set_action_and_target_value(item, "indicator.remove-notification", g_variant_new_int64(nTimestamp));
-    g_menu_item_set_attribute_value(item, "x-ayatana-timestamp", g_variant_new_int64(nTimestamp));
-    g_menu_item_set_attribute_value(item, "x-ayatana-use-markup", g_variant_new_boolean(TRUE));
-    g_menu_item_set_attribute(item, "x-ayatana-type", "s", "org.ayatana.indicator.removable");
+// Ends the running frame, for changes to the menu that cannot wait for it
+static void flushFrame(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+
+    showPending(self);
 
-    GList *last_item;
-    GMenuItem *last_menu_item;
+    if (p->nFrameId != 0)
+    {
+        g_source_remove(p->nFrameId);
+        p->nFrameId = 0;
+    }
+}
 
-    // List holds a ref to the menuitem
-    self->priv->lVisibleItems = g_list_prepend(self->priv->lVisibleItems, g_object_ref(item));
-    g_menu_prepend_item (self->priv->pNotificationsSection, item);
-    g_object_unref(item);
+static void onMessagesReceived(DBusSpy *pBusSpy, GPtrArray *lNotes, gpointer user_data)
+{
+    g_return_if_fail(IS_DBUS_SPY(pBusSpy));
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+    priv_t *p = self->priv;
+    guint nAdded = 0;
+    guint nUpdated = 0;
+    gboolean bUrgent = FALSE;
+    guint i;
 
-    // Move items that overflow to the hidden list
-    while (g_list_length(self->priv->lVisibleItems) > self->priv->nMaxItems)
+    for (i = 0; i < lNotes->len; i++)
     {
-        last_item = g_list_last(self->priv->lVisibleItems);
-        last_menu_item = G_MENU_ITEM(last_item->data);
+        Notification *note = NOTIFICATION(g_ptr_array_index(lNotes, i));
+
+        if (notification_get_replaces_id(note) != 0 && replaceRecord(self, note, p->nPending))
+        {
+            nUpdated++;
 
-        // Steal the ref from the visible list
-        self->priv->lVisibleItems = g_list_delete_link(self->priv->lVisibleItems, last_item);
-        self->priv->lHiddenItems = g_list_prepend(self->priv->lHiddenItems, last_menu_item);
-        last_item = NULL;
-        last_menu_item = NULL;
+            continue;
+        }
+
+        if (repeatRecord(self, note, p->nPending))
+        {
+            stats_count(STATS_COUNTER_DEDUPLICATED);
+            nUpdated++;
+
+            continue;
+        }
+
+        // Private, empty and filtered notifications never get here, the bus spy drops them
+        updateHints(self, note);
+
+        if (!rate_limiter_admit(p->pRateLimiter, notification_get_app_name(note), g_get_monotonic_time()))
+        {
+            stats_count(STATS_COUNTER_RATE_LIMITED);
+
+            if (showOverflow(self, note, p->nPending))
+            {
+                p->nPending++;
+                nAdded++;
+            }
+            else
+            {
+                nUpdated++;
+            }
+
+            continue;
+        }
+
+        if (notification_store_is_full(p->pStore))
+        {
+            forgetOldest(self);
+        }
+
+        // The record id is the target of the remove action
+        guint nSlot = notification_store_prepend(p->pStore);
+        NotificationRecord *pRecord = notification_store_get(p->pStore, nSlot);
+        HistoryEntry entry;
+
+        // The note remembers the record for the server's reply
+        fillHistoryEntry(&entry, note, pRecord->id);
+        setRecordText(self, nSlot, &entry);
+        pRecord->timestamp = entry.timestamp;
+        notification_set_id(note, pRecord->id);
+        p->nPending++;
+        nAdded++;
+
+        if (notification_get_urgency(note) == NOTIFICATION_URGENCY_CRITICAL)
+        {
+            bUrgent = TRUE;
+        }
+
+        if (p->pHistory != NULL)
+        {
+            history_append(p->pHistory, &entry);
+        }
     }
 
-    while (g_menu_model_get_n_items(G_MENU_MODEL(self->priv->pNotificationsSection)) > self->priv->nMaxItems)
+    if (nAdded == 0)
     {
-        g_menu_remove(self->priv->pNotificationsSection, self->priv->nMaxItems);
+        if (nUpdated != 0)
+        {
+            setUnread(self, TRUE);
+        }
+
+        return;
     }
 
+    scheduleFrame(self, bUrgent);
     updateClearItem(self);
     setUnread(self, TRUE);
 }
 
-static GVariant *createHeaderState(IndicatorNotificationsService *self)
+static void onNotificationAcknowledged(DBusSpy *pBusSpy, Notification *note, guint nServerId, gpointer user_data)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+    priv_t *p = self->priv;
+    guint nSlot = notification_store_lookup(p->pStore, notification_get_id(note));
+
+    // Not stored or already forgotten
+    if (nSlot == NOTIFICATION_STORE_NONE)
+    {
+        return;
+    }
+
+    NotificationRecord *pRecord = notification_store_get(p->pStore, nSlot);
+    gpointer pOther;
+
+    if (pRecord->server_id == nServerId)
+    {
+        return;
+    }
+
+    if (pRecord->server_id != 0)
+    {
+        g_hash_table_remove(p->lServerIds, GUINT_TO_POINTER(pRecord->server_id));
+    }
+
+    // The server reused an id, so the older record can no longer be replaced
+    if (g_hash_table_lookup_extended(p->lServerIds, GUINT_TO_POINTER(nServerId), NULL, &pOther))
+    {
+        notification_store_get(p->pStore, GPOINTER_TO_UINT(pOther))->server_id = 0;
+    }
+
+    pRecord->server_id = nServerId;
+    g_hash_table_insert(p->lServerIds, GUINT_TO_POINTER(nServerId), GUINT_TO_POINTER(nSlot));
+}
+
+static GVariant *createHeaderState(IndicatorNotificationsService *self, guint nState)
 {
     GVariantBuilder b;
 
@@ -279,32 +811,8 @@ static GVariant *createHeaderState(IndicatorNotificationsService *self)
     {
         g_variant_builder_add (&b, "{sv}", "visible", g_variant_new_boolean (TRUE));
     }
-    gchar *sIcon = NULL;
 
-    if (self->priv->bHasUnread)
-    {
-        if (self->priv->bHasDoNotDisturb && self->priv->bDoNotDisturb)
-        {
-            sIcon = "ayatana-indicator-notification-unread-dnd";
-        }
-        else
-        {
-            sIcon = "ayatana-indicator-notification-unread";
-        }
-    }
-    else
-    {
-        if (self->priv->bHasDoNotDisturb && self->priv->bDoNotDisturb)
-        {
-            sIcon = "ayatana-indicator-notification-read-dnd";
-        }
-        else
-        {
-            sIcon = "ayatana-indicator-notification-read";
-        }
-    }
-
-    GIcon * icon = g_themed_icon_new_with_default_fallbacks(sIcon);
+    GIcon * icon = g_themed_icon_new_with_default_fallbacks(header_icons[nState]);
     g_variant_builder_add (&b, "{sv}", "accessible-desc", g_variant_new_string (_("Notifications")));
 
     if (icon)
@@ -323,11 +831,44 @@ static GVariant *createHeaderState(IndicatorNotificationsService *self)
     return g_variant_builder_end (&b);
 }
 
+static guint getHeaderStateIndex(IndicatorNotificationsService *self)
+{
+    guint nState = self->priv->bHasUnread ? HEADER_UNREAD : HEADER_READ;
+
+    if (self->priv->bHasDoNotDisturb && self->priv->bDoNotDisturb)
+    {
+        nState++;
+    }
+
+    return nState;
+}
+
+/*
+ * The four possible states are built on first use and kept. The locale and
+ * the Lomiri check are fixed for the lifetime of the process, so they never
+ * need to be rebuilt.
+ */
+static GVariant *getHeaderState(IndicatorNotificationsService *self, guint nState)
+{
+    GVariant **pState = &self->priv->lHeaderStates[nState];
+
+    if (*pState == NULL)
+    {
+        *pState = g_variant_ref_sink(createHeaderState(self, nState));
+    }
+
+    return *pState;
+}
+
 static GMenuModel *createDesktopNotificationsSection(IndicatorNotificationsService *self, int profile)
 {
-    self->priv->pNotificationsSection = g_menu_new();
+    // Every profile shows the same section, so it is kept up to date in one place
+    if (self->priv->pNotificationsSection == NULL)
+    {
+        self->priv->pNotificationsSection = menu_section_new();
+    }
 
-    return G_MENU_MODEL(self->priv->pNotificationsSection);
+    return G_MENU_MODEL(g_object_ref(self->priv->pNotificationsSection));
 }
 
 static GMenuModel *createDesktopClearSection(IndicatorNotificationsService *self)
@@ -338,11 +879,13 @@ static GMenuModel *createDesktopClearSection(IndicatorNotificationsService *self
     return G_MENU_MODEL(pMenu);
 }
 
-static GMenuModel *createDesktopDoNotDisturbSection(IndicatorNotificationsService *self)
+static void updateDoNotDisturbSection(IndicatorNotificationsService *self)
 {
-    GMenu *pMenu = g_menu_new();
+    GMenu *pMenu = self->priv->pDoNotDisturbSection;
+    gboolean bShown = g_menu_model_get_n_items(G_MENU_MODEL(pMenu)) != 0;
 
-    if (self->priv->bHasDoNotDisturb)
+    // The switch follows the action state, only a change in availability touches the menu
+    if (self->priv->bHasDoNotDisturb && !bShown)
     {
         GMenuItem *item = g_menu_item_new(_("Do not disturb"), NULL);
         g_menu_item_set_attribute(item, "x-ayatana-type", "s", "org.ayatana.indicator.switch");
@@ -350,46 +893,42 @@ static GMenuModel *createDesktopDoNotDisturbSection(IndicatorNotificationsServic
         g_menu_append_item(pMenu, item);
         g_object_unref(item);
     }
-
-    return G_MENU_MODEL(pMenu);
+    else if (!self->priv->bHasDoNotDisturb && bShown)
+    {
+        g_menu_remove(pMenu, 0);
+    }
 }
 
-static void rebuildSection(GMenu *parent, int pos, GMenuModel *new_section)
+static GMenuModel *createDesktopDoNotDisturbSection(IndicatorNotificationsService *self)
 {
-    g_menu_remove (parent, pos);
-    g_menu_insert_section (parent, pos, NULL, new_section);
-    g_object_unref (new_section);
+    if (self->priv->pDoNotDisturbSection == NULL)
+    {
+        self->priv->pDoNotDisturbSection = g_menu_new();
+        updateDoNotDisturbSection(self);
+    }
+
+    return G_MENU_MODEL(g_object_ref(self->priv->pDoNotDisturbSection));
 }
 
 static void rebuildNow(IndicatorNotificationsService *self, guint sections)
 {
     priv_t *p = self->priv;
-    struct ProfileMenuInfo *desktop = &p->lMenus[PROFILE_DESKTOP];
+    gint64 nStart = stats_trace_begin();
 
     if (sections & SECTION_HEADER)
     {
-        g_simple_action_set_state (p->pHeaderAction, createHeaderState (self));
-    }
-
-    if (!p->bMenusBuilt)
-    {
-        return;
-    }
-
-    if (sections & SECTION_NOTIFICATIONS)
-    {
-        rebuildSection (desktop->pSubmenu, 0, createDesktopNotificationsSection (self, PROFILE_DESKTOP));
-    }
+        guint nState = getHeaderStateIndex(self);
 
-    if (sections & SECTION_DO_NOT_DISTURB)
-    {
-        rebuildSection (desktop->pSubmenu, 1, createDesktopDoNotDisturbSection (self));
+        // Floods of notifications keep setting the same state, only changes go out on the bus
+        if (nState != p->nHeaderState)
+        {
+            p->nHeaderState = nState;
+            g_simple_action_set_state (p->pHeaderAction, getHeaderState (self, nState));
+        }
     }
 
-    if (sections & SECTION_CLEAR)
-    {
-        rebuildSection (desktop->pSubmenu, 2, createDesktopClearSection (self));
-    }
+    // The other sections are updated in place by whatever changes them
+    stats_trace_end("rebuild", nStart);
 }
 
 static void createMenu(IndicatorNotificationsService *self, int profile)
@@ -446,18 +985,21 @@ static void createMenu(IndicatorNotificationsService *self, int profile)
 
 static void clearMenuItems(IndicatorNotificationsService *self)
 {
-    // Remove each visible item from the menu
-    while (g_menu_model_get_n_items(G_MENU_MODEL(self->priv->pNotificationsSection)) > 0)
+    menu_section_remove_all(self->priv->pNotificationsSection);
+
+    // Forget the history
+    g_hash_table_remove_all(self->priv->lServerIds);
+    g_hash_table_remove_all(self->priv->lContents);
+    notification_store_clear(self->priv->pStore);
+
+    if (self->priv->pHistory != NULL)
     {
-        g_menu_remove(self->priv->pNotificationsSection, 0);
+        history_clear(self->priv->pHistory);
     }
 
-    // Clear the lists
-    g_list_free_full(self->priv->lVisibleItems, g_object_unref);
-    self->priv->lVisibleItems = NULL;
-
-    g_list_free_full(self->priv->lHiddenItems, g_object_unref);
-    self->priv->lHiddenItems = NULL;
+    self->priv->nVisibleItems = 0;
+    self->priv->nLastVisible = NOTIFICATION_STORE_NONE;
+    self->priv->nPending = 0;
 
     updateClearItem(self);
 }
@@ -465,53 +1007,54 @@ static void clearMenuItems(IndicatorNotificationsService *self)
 static void onRemoveNotification(GSimpleAction *a, GVariant *param, gpointer user_data)
 {
     IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
-    guint nItems = g_menu_model_get_n_items(G_MENU_MODEL(self->priv->pNotificationsSection));
-    gint64 nTimestampIn = g_variant_get_int64(param);
+    priv_t *p = self->priv;
+    guint nSlot = notification_store_lookup(p->pStore, (guint64) g_variant_get_int64(param));
 
-    for (guint nItem = 0; nItem < nItems; nItem++)
+    if (nSlot == NOTIFICATION_STORE_NONE)
     {
-        gint64 nTimestamp;
-        g_menu_model_get_item_attribute(G_MENU_MODEL(self->priv->pNotificationsSection), nItem, "x-ayatana-timestamp", "x", &nTimestamp);
+        return;
+    }
+
+    flushFrame(self);
+
+    guint nItem = getMenuPosition(self, nSlot, 0);
+
+    if (nItem >= p->nVisibleItems)
+    {
+        return;
+    }
 
-        if (nTimestamp == nTimestampIn)
-        {
-            g_menu_remove(self->priv->pNotificationsSection, nItem);
+    // The first hidden record takes the place of the removed one
+    guint nHidden = notification_store_older(p->pStore, p->nLastVisible);
 
-            break;
-        }
+    if (nSlot == p->nLastVisible)
+    {
+        p->nLastVisible = notification_store_newer(p->pStore, nSlot);
     }
 
-    for (GList *pItem = self->priv->lVisibleItems; pItem; pItem = pItem->next)
+    if (p->pHistory != NULL)
     {
-        gint64 nTimestamp;
-        g_menu_item_get_attribute(G_MENU_ITEM(pItem->data), "x-ayatana-timestamp", "x", &nTimestamp);
-
-        if (nTimestamp == nTimestampIn)
-        {
-            // Remove the item
-            self->priv->lVisibleItems = g_list_delete_link(self->priv->lVisibleItems, pItem);
-
-            // Add an item from the hidden list, if available
-            if (g_list_length(self->priv->lHiddenItems) > 0)
-            {
-                pItem = g_list_first(self->priv->lHiddenItems);
-                GMenuItem *pMenuItem = G_MENU_ITEM(pItem->data);
-                self->priv->lHiddenItems = g_list_delete_link(self->priv->lHiddenItems, pItem);
-                g_menu_append_item(self->priv->pNotificationsSection, pMenuItem);
+        history_remove(p->pHistory, notification_store_get(p->pStore, nSlot)->id);
+    }
 
-                // Steal the ref back from the hidden list
-                self->priv->lVisibleItems = g_list_append(self->priv->lVisibleItems, pMenuItem);
-            }
+    menu_section_remove(p->pNotificationsSection, nItem);
+    forgetRecord(self, nSlot);
+    p->nVisibleItems--;
 
-            updateClearItem(self);
+    if (nHidden != NOTIFICATION_STORE_NONE)
+    {
+        GHashTable *item = renderRecord(self, nHidden);
+        menu_section_insert(p->pNotificationsSection, p->nVisibleItems, item);
+        g_hash_table_unref(item);
+        p->nLastVisible = nHidden;
+        p->nVisibleItems++;
+    }
 
-            if (self->priv->lVisibleItems == NULL)
-            {
-                setUnread(self, FALSE);
-            }
+    updateClearItem(self);
 
-            break;
-        }
+    if (p->nVisibleItems == 0)
+    {
+        setUnread(self, FALSE);
     }
 }
 
@@ -538,14 +1081,95 @@ static void onDoNotDisturb(GSimpleAction *a, GVariant *param, gpointer user_data
     }
 }
 
+// Shows or hides the oldest visible items to fit a new max-items
+static void updateMaxItems(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+
+    // Pending records are the newest, they must be in the menu before older ones are added behind them
+    flushFrame(self);
+    p->nMaxItems = g_settings_get_int(p->pSettings, "max-items");
+
+    if (p->nVisibleItems > (guint) p->nMaxItems)
+    {
+        hideOldestVisible(self, p->nVisibleItems - p->nMaxItems);
+    }
+    else
+    {
+        showOlder(self, p->nMaxItems - p->nVisibleItems);
+    }
+}
+
+// Drops the oldest records that no longer fit a new max-history-items
+static void updateMaxHistoryItems(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+    guint nCapacity = g_settings_get_int(p->pSettings, "max-history-items");
+
+    while (notification_store_get_length(p->pStore) > nCapacity)
+    {
+        forgetOldest(self);
+    }
+
+    notification_store_set_capacity(p->pStore, nCapacity);
+
+    if (p->pHistory != NULL)
+    {
+        history_set_keep(p->pHistory, nCapacity);
+    }
+
+    updateClearItem(self);
+}
+
 static void onSettingsChanged(GSettings *pSettings, gchar *key, gpointer user_data)
 {
     IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
 
-    if (g_str_equal(key, "filter-list"))
+    if (g_str_equal(key, "filter-list") || g_str_equal(key, "filter-rules"))
     {
         updateFilters(self);
     }
+    else if (g_str_equal(key, "persist-history"))
+    {
+        gboolean bWasPersisting = self->priv->pHistory != NULL;
+
+        updateHistory(self);
+
+        // A log left from an earlier run holds ids the store hands out again, so start it over
+        if (!bWasPersisting && self->priv->pHistory != NULL)
+        {
+            history_clear(self->priv->pHistory);
+        }
+    }
+    else if (g_str_equal(key, "queue-limit") || g_str_equal(key, "queue-overload-policy"))
+    {
+        updateQueueLimit(self);
+    }
+    else if (g_str_equal(key, "rate-limit-burst") || g_str_equal(key, "rate-limit-per-minute"))
+    {
+        rate_limiter_set_limits(self->priv->pRateLimiter, g_settings_get_int(self->priv->pSettings, "rate-limit-burst"), g_settings_get_int(self->priv->pSettings, "rate-limit-per-minute"));
+    }
+    else if (g_str_equal(key, "max-items"))
+    {
+        updateMaxItems(self);
+    }
+    else if (g_str_equal(key, "max-history-items"))
+    {
+        updateMaxHistoryItems(self);
+    }
+    else if (g_str_equal(key, "dedup-window"))
+    {
+        self->priv->nDedupWindow = g_settings_get_int(self->priv->pSettings, key);
+    }
+    else if (g_str_equal(key, "menu-frame-interval"))
+    {
+        // The running frame keeps its interval, the next one gets the new one
+        self->priv->nFrameInterval = g_settings_get_int(self->priv->pSettings, key);
+    }
+    else if (g_str_equal(key, "link-scan-budget"))
+    {
+        urlregex_set_step_budget(g_settings_get_int(self->priv->pSettings, key));
+    }
     else if (g_str_equal(key, "do-not-disturb"))
     {
         if (self->priv->bHasDoNotDisturb)
@@ -571,7 +1195,8 @@ static void initActions(IndicatorNotificationsService *self)
     self->priv->pActionGroup = g_simple_action_group_new();
 
     // Add the header action
-    a = g_simple_action_new_stateful ("_header", NULL, createHeaderState(self));
+    self->priv->nHeaderState = getHeaderStateIndex(self);
+    a = g_simple_action_new_stateful ("_header", NULL, getHeaderState(self, self->priv->nHeaderState));
     g_action_map_add_action(G_ACTION_MAP(self->priv->pActionGroup), G_ACTION(a));
     self->priv->pHeaderAction = a;
 
@@ -606,6 +1231,31 @@ static void initActions(IndicatorNotificationsService *self)
     g_object_unref(max_items_action);
 }
 
+static void addDropped(const gchar *sAppName, guint nDropped, gpointer user_data)
+{
+    g_variant_builder_add((GVariantBuilder *) user_data, "{su}", sAppName, nDropped);
+}
+
+static void fillMetrics(GVariantBuilder *pBuilder, gpointer user_data)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+    priv_t *p = self->priv;
+    GVariantBuilder lDropped;
+    guint nHighWater;
+
+    g_variant_builder_add(pBuilder, "{sv}", "store-length", g_variant_new_uint32(notification_store_get_length(p->pStore)));
+    g_variant_builder_add(pBuilder, "{sv}", "store-capacity", g_variant_new_uint32(notification_store_get_capacity(p->pStore)));
+    g_variant_builder_add(pBuilder, "{sv}", "store-bytes", g_variant_new_uint64(notification_store_get_size(p->pStore)));
+    g_variant_builder_add(pBuilder, "{sv}", "visible", g_variant_new_uint32(p->nVisibleItems));
+    dbus_spy_get_queue_stats(p->pBusSpy, &nHighWater);
+    g_variant_builder_add(pBuilder, "{sv}", "queue-high-water", g_variant_new_uint32(nHighWater));
+
+    // Per application counts of the rate-limited counter
+    g_variant_builder_init(&lDropped, G_VARIANT_TYPE("a{su}"));
+    rate_limiter_foreach(p->pRateLimiter, addDropped, &lDropped);
+    g_variant_builder_add(pBuilder, "{sv}", "rate-limited-by-app", g_variant_builder_end(&lDropped));
+}
+
 static void onBusAcquired(GDBusConnection *connection, const gchar *name, gpointer gself)
 {
     int i;
@@ -630,6 +1280,17 @@ static void onBusAcquired(GDBusConnection *connection, const gchar *name, gpoint
         g_clear_error (&err);
     }
 
+    // Export the metrics next to the actions
+    if ((id = metrics_export (connection, BUS_PATH, fillMetrics, self, &err)))
+    {
+        p->nMetricsId = id;
+    }
+    else
+    {
+        g_warning ("cannot export metrics: %s", err->message);
+        g_clear_error (&err);
+    }
+
     // Export the menus
     for (i=0; i<N_PROFILES; ++i)
     {
@@ -674,6 +1335,13 @@ static void unexport(IndicatorNotificationsService *self)
         g_dbus_connection_unexport_action_group (p->pConnection, p->nActionsId);
         p->nActionsId = 0;
     }
+
+    // Unexport the metrics
+    if (p->nMetricsId)
+    {
+        g_dbus_connection_unregister_object (p->pConnection, p->nMetricsId);
+        p->nMetricsId = 0;
+    }
 }
 
 static void onNameLost(GDBusConnection *connection, const gchar *name, gpointer gself)
@@ -689,35 +1357,72 @@ static void onDispose(GObject *o)
 {
     IndicatorNotificationsService * self = INDICATOR_NOTIFICATIONS_SERVICE(o);
     priv_t * p = self->priv;
+    guint i;
 
-    if (self->priv->lVisibleItems != NULL)
+    // A flush the spy already scheduled holds its own ref and must not reach the cleared store
+    if (self->priv->pBusSpy != NULL)
     {
-        g_list_free_full(self->priv->lVisibleItems, g_object_unref);
-        self->priv->lVisibleItems = NULL;
+        g_signal_handlers_disconnect_by_data(self->priv->pBusSpy, self);
+        g_object_unref(G_OBJECT(self->priv->pBusSpy));
+        self->priv->pBusSpy = NULL;
     }
 
-    if (self->priv->lHiddenItems != NULL)
+    if (p->nFrameId != 0)
     {
-        g_list_free_full(self->priv->lHiddenItems, g_object_unref);
-        self->priv->lHiddenItems = NULL;
+        g_source_remove(p->nFrameId);
+        p->nFrameId = 0;
     }
 
-    if (self->priv->pBusSpy != NULL)
+    if (self->priv->pStore != NULL)
     {
-        g_object_unref(G_OBJECT(self->priv->pBusSpy));
-        self->priv->pBusSpy = NULL;
+        notification_store_free(self->priv->pStore);
+        self->priv->pStore = NULL;
+    }
+
+    if (self->priv->lServerIds != NULL)
+    {
+        g_hash_table_destroy(self->priv->lServerIds);
+        self->priv->lServerIds = NULL;
+    }
+
+    if (self->priv->lContents != NULL)
+    {
+        g_hash_table_destroy(self->priv->lContents);
+        self->priv->lContents = NULL;
+    }
+
+    if (self->priv->pRateLimiter != NULL)
+    {
+        rate_limiter_free(self->priv->pRateLimiter);
+        self->priv->pRateLimiter = NULL;
+    }
+
+    if (self->priv->pRules != NULL)
+    {
+        rule_set_unref(self->priv->pRules);
+        self->priv->pRules = NULL;
     }
 
-    if(self->priv->lFilters != NULL)
+    if (self->priv->pHistory != NULL)
     {
-        g_hash_table_unref(self->priv->lFilters);
-        self->priv->lFilters = NULL;
+        history_free(self->priv->pHistory);
+        self->priv->pHistory = NULL;
     }
 
-    if(self->priv->lHints != NULL)
+    // Pending hints are written before the settings go away
+    if (p->nSaveHintsId != 0)
     {
-        g_list_free_full(self->priv->lHints, g_free);
-        self->priv->lHints = NULL;
+        g_source_remove(p->nSaveHintsId);
+        p->nSaveHintsId = 0;
+        saveHints(self);
+    }
+
+    if (self->priv->lHintLinks != NULL)
+    {
+        g_hash_table_destroy(self->priv->lHintLinks);
+        self->priv->lHintLinks = NULL;
+        g_queue_foreach(&self->priv->lHints, (GFunc) g_free, NULL);
+        g_queue_clear(&self->priv->lHints);
     }
 
     if (p->nOwnId)
@@ -748,38 +1453,162 @@ static void onDispose(GObject *o)
     g_clear_object (&p->pClearAction);
     g_clear_object (&p->pRemoveAction);
     g_clear_object (&p->pHeaderAction);
+
+    // Each cached header state holds one reference, dropped here and cleared so a second dispose is a no-op
+    for (i = 0; i < N_HEADER_STATES; i++)
+    {
+        if (p->lHeaderStates[i] != NULL)
+        {
+            g_variant_unref (p->lHeaderStates[i]);
+            p->lHeaderStates[i] = NULL;
+        }
+    }
+
     g_clear_object (&p->pActionGroup);
     g_clear_object (&p->pConnection);
+    g_clear_object (&p->pNotificationsSection);
+    g_clear_object (&p->pDoNotDisturbSection);
 
     G_OBJECT_CLASS (indicator_notifications_service_parent_class)->dispose (o);
 }
 
+static void onFinalize(GObject *o)
+{
+    g_free(INDICATOR_NOTIFICATIONS_SERVICE(o)->priv->sBusAddress);
+
+    G_OBJECT_CLASS (indicator_notifications_service_parent_class)->finalize (o);
+}
+
 static void updateFilters(IndicatorNotificationsService *self)
 {
-    g_return_if_fail(self->priv->lFilters != NULL);
+    priv_t *p = self->priv;
 
-    g_hash_table_remove_all(self->priv->lFilters);
-    gchar **items = g_settings_get_strv(self->priv->pSettings, "filter-list");
-    int i;
+    g_return_if_fail(p->pBusSpy != NULL);
+
+    // Rules that did not change are taken over from the current set, the bus spy reads the published one from its worker thread
+    // Every service reads the same settings, so all buses of an aggregator share the rules
+    gchar **lAppNames = g_settings_get_strv(p->pSettings, "filter-list");
+    gchar **lRules = g_settings_get_strv(p->pSettings, "filter-rules");
+    RuleSet *pRules = rule_set_new((const gchar * const *) lAppNames, (const gchar * const *) lRules, p->pRules);
+
+    g_strfreev(lAppNames);
+    g_strfreev(lRules);
+
+    if (p->pRules != NULL)
+    {
+        rule_set_unref(p->pRules);
+    }
+
+    p->pRules = pRules;
+    dbus_spy_set_rules(p->pBusSpy, pRules);
+}
+
+static void updateQueueLimit(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+    gchar *sPolicy = g_settings_get_string(p->pSettings, "queue-overload-policy");
+    DBusSpyOverloadPolicy nPolicy = DBUS_SPY_DROP_OLDEST;
+
+    if (g_str_equal(sPolicy, "drop-newest"))
+    {
+        nPolicy = DBUS_SPY_DROP_NEWEST;
+    }
+    else if (g_str_equal(sPolicy, "drop-lowest-urgency"))
+    {
+        nPolicy = DBUS_SPY_DROP_LOWEST_URGENCY;
+    }
+
+    dbus_spy_set_queue_limit(p->pBusSpy, g_settings_get_int(p->pSettings, "queue-limit"), nPolicy);
+    g_free(sPolicy);
+}
+
+static void onHistoryEntry(const HistoryEntry *pEntry, gpointer user_data)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(user_data);
+    priv_t *p = self->priv;
 
-    for(i = 0; items[i] != NULL; i++)
+    if (notification_store_is_full(p->pStore))
     {
-        g_hash_table_insert(self->priv->lFilters, g_strdup(items[i]), NULL);
+        forgetOldest(self);
     }
 
-    g_strfreev(items);
+    // Restored records keep their ids, so the log can keep referring to them
+    guint nSlot = notification_store_prepend_with_id(p->pStore, pEntry->id);
+    notification_store_get(p->pStore, nSlot)->timestamp = pEntry->timestamp;
+    setRecordText(self, nSlot, pEntry);
+}
+
+static void loadHistory(IndicatorNotificationsService *self)
+{
+    // Restored records go in front of the menu, so nothing may be waiting for a frame
+    flushFrame(self);
+
+    guint nLoaded = history_load(self->priv->pHistory, onHistoryEntry, self);
+
+    showNewest(self, nLoaded);
+    updateClearItem(self);
+}
+
+static void updateHistory(IndicatorNotificationsService *self)
+{
+    priv_t *p = self->priv;
+    gboolean bPersist = g_settings_get_boolean(p->pSettings, "persist-history");
+
+    if (bPersist && p->pHistory == NULL)
+    {
+        gchar *sPath;
+
+        // Every bus keeps its own history, named after its address
+        if (p->sBusAddress == NULL)
+        {
+            sPath = g_build_filename(g_get_user_cache_dir(), "ayatana-indicator-notifications", "history", NULL);
+        }
+        else
+        {
+            gchar *sChecksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, p->sBusAddress, -1);
+            gchar *sName = g_strconcat("history-", sChecksum, NULL);
+
+            sPath = g_build_filename(g_get_user_cache_dir(), "ayatana-indicator-notifications", sName, NULL);
+            g_free(sName);
+            g_free(sChecksum);
+        }
+
+        p->pHistory = history_new(sPath, notification_store_get_capacity(p->pStore));
+        g_free(sPath);
+    }
+    else if (!bPersist && p->pHistory != NULL)
+    {
+        // Nothing may stay behind on disk once the user opts out
+        history_clear(p->pHistory);
+        history_free(p->pHistory);
+        p->pHistory = NULL;
+    }
 }
 
 static void loadHints(IndicatorNotificationsService *self)
 {
-    g_return_if_fail(self->priv->lHints == NULL);
+    priv_t *p = self->priv;
 
-    gchar **items = g_settings_get_strv(self->priv->pSettings, "filter-list-hints");
+    g_return_if_fail(p->lHintLinks == NULL);
+
+    gchar **items = g_settings_get_strv(p->pSettings, "filter-list-hints");
     int i;
 
+    // The list owns the names, the index only points at them
+    g_queue_init(&p->lHints);
+    p->lHintLinks = g_hash_table_new(g_str_hash, g_str_equal);
+
     for (i = 0; items[i] != NULL; i++)
     {
-        self->priv->lHints = g_list_prepend(self->priv->lHints, items[i]);
+        if (p->lHints.length < HINT_MAX && !g_hash_table_contains(p->lHintLinks, items[i]))
+        {
+            g_queue_push_tail(&p->lHints, items[i]);
+            g_hash_table_insert(p->lHintLinks, items[i], p->lHints.tail);
+        }
+        else
+        {
+            g_free(items[i]);
+        }
     }
 
     g_free(items);
@@ -833,26 +1662,24 @@ static void indicator_notifications_service_init(IndicatorNotificationsService *
     self->priv->bHasDoNotDisturb = getDoNotDisturb();
     self->priv->pSettings = g_settings_new("org.ayatana.indicator.notifications");
     self->priv->bHasUnread = FALSE;
-    self->priv->lVisibleItems = NULL;
-    self->priv->lHiddenItems = NULL;
-
-    // Watch for notifications from dbus
-    self->priv->pBusSpy = dbus_spy_new();
-    g_signal_connect(self->priv->pBusSpy, DBUS_SPY_SIGNAL_MESSAGE_RECEIVED, G_CALLBACK(onMessageReceived), self);
+    self->priv->pStore = notification_store_new(g_settings_get_int(self->priv->pSettings, "max-history-items"));
+    self->priv->nVisibleItems = 0;
+    self->priv->nLastVisible = NOTIFICATION_STORE_NONE;
+    self->priv->lServerIds = g_hash_table_new(g_direct_hash, g_direct_equal);
+    self->priv->lContents = g_hash_table_new(g_direct_hash, g_direct_equal);
+    self->priv->nDedupWindow = g_settings_get_int(self->priv->pSettings, "dedup-window");
+    self->priv->nFrameInterval = g_settings_get_int(self->priv->pSettings, "menu-frame-interval");
+    self->priv->pRateLimiter = rate_limiter_new(g_settings_get_int(self->priv->pSettings, "rate-limit-burst"), g_settings_get_int(self->priv->pSettings, "rate-limit-per-minute"));
 
-    // Initialize an empty filter list
-    self->priv->lFilters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
     self->priv->nMaxItems = g_settings_get_int(self->priv->pSettings, "max-items");
+    urlregex_set_step_budget(g_settings_get_int(self->priv->pSettings, "link-scan-budget"));
 
     if (self->priv->bHasDoNotDisturb)
     {
         self->priv->bDoNotDisturb = g_settings_get_boolean(self->priv->pSettings, "do-not-disturb");
     }
 
-    updateFilters(self);
-
     // Set up filter-list hints
-    self->priv->lHints = NULL;
     loadHints(self);
 
     initActions(self);
@@ -861,15 +1688,127 @@ static void indicator_notifications_service_init(IndicatorNotificationsService *
     {
         createMenu(self, i);
     }
+}
+
+static void onConnectionReady(GObject *pSource, GAsyncResult *pResult, gpointer gself)
+{
+    GError *err = NULL;
+    GDBusConnection *connection = g_dbus_connection_new_for_address_finish(pResult, &err);
+
+    // A cancelled connection means the service is gone
+    if (connection == NULL)
+    {
+        if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+            g_warning("cannot connect to the bus: %s", err->message);
+        }
+
+        g_error_free(err);
+
+        return;
+    }
+
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(gself);
+
+    // Same order as g_bus_own_name(): export first, then ask for the name
+    onBusAcquired(connection, BUS_NAME, self);
+    self->priv->nOwnId = g_bus_own_name_on_connection(connection, BUS_NAME, G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT, NULL, onNameLost, self, NULL);
+    g_object_unref(connection);
+}
+
+// Everything that depends on the bus, which is only known once the properties are set
+static void onConstructed(GObject *o)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(o);
+    priv_t *p = self->priv;
+
+    G_OBJECT_CLASS(indicator_notifications_service_parent_class)->constructed(o);
+
+    // Watch for notifications from dbus
+    if (p->sBusAddress == NULL)
+    {
+        p->pBusSpy = dbus_spy_new();
+    }
+    else
+    {
+        p->pBusSpy = dbus_spy_new_for_address(p->sBusAddress, DBUS_SPY_CAPTURE_AUTO);
+    }
+
+    g_signal_connect(p->pBusSpy, DBUS_SPY_SIGNAL_MESSAGES_RECEIVED, G_CALLBACK(onMessagesReceived), self);
+    g_signal_connect(p->pBusSpy, DBUS_SPY_SIGNAL_NOTIFICATION_ACKNOWLEDGED, G_CALLBACK(onNotificationAcknowledged), self);
+    updateQueueLimit(self);
+    updateFilters(self);
+
+    // Bring back what was shown before a restart
+    updateHistory(self);
+
+    if (p->pHistory != NULL)
+    {
+        loadHistory(self);
+    }
+
+    if (p->sBusAddress == NULL)
+    {
+        p->nOwnId = g_bus_own_name(G_BUS_TYPE_SESSION, BUS_NAME, G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT, onBusAcquired, NULL, onNameLost, self, NULL);
+    }
+    else
+    {
+        g_dbus_connection_new_for_address(p->sBusAddress, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, p->pCancellable, onConnectionReady, self);
+    }
+}
+
+static void onSetProperty(GObject *o, guint nProperty, const GValue *pValue, GParamSpec *pSpec)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(o);
+
+    switch (nProperty)
+    {
+        case PROP_BUS_ADDRESS:
+        {
+            g_free(self->priv->sBusAddress);
+            self->priv->sBusAddress = g_value_dup_string(pValue);
+
+            break;
+        }
+        default:
+        {
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(o, nProperty, pSpec);
+
+            break;
+        }
+    }
+}
+
+static void onGetProperty(GObject *o, guint nProperty, GValue *pValue, GParamSpec *pSpec)
+{
+    IndicatorNotificationsService *self = INDICATOR_NOTIFICATIONS_SERVICE(o);
+
+    switch (nProperty)
+    {
+        case PROP_BUS_ADDRESS:
+        {
+            g_value_set_string(pValue, self->priv->sBusAddress);
+
+            break;
+        }
+        default:
+        {
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(o, nProperty, pSpec);
 
-    self->priv->bMenusBuilt = TRUE;
-    self->priv->nOwnId = g_bus_own_name(G_BUS_TYPE_SESSION, BUS_NAME, G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT, onBusAcquired, NULL, onNameLost, self, NULL);
+            break;
+        }
+    }
 }
 
 static void indicator_notifications_service_class_init(IndicatorNotificationsServiceClass *klass)
 {
     GObjectClass *object_class = G_OBJECT_CLASS(klass);
     object_class->dispose = onDispose;
+    object_class->finalize = onFinalize;
+    object_class->constructed = onConstructed;
+    object_class->set_property = onSetProperty;
+    object_class->get_property = onGetProperty;
+    g_object_class_install_property(object_class, PROP_BUS_ADDRESS, g_param_spec_string("bus-address", "Bus address", "The bus to watch and export on, NULL for the session bus", NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
     m_nSignal = g_signal_new(INDICATOR_NOTIFICATIONS_SERVICE_SIGNAL_NAME_LOST, G_TYPE_FROM_CLASS(klass), G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET (IndicatorNotificationsServiceClass, name_lost), NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
 }
 
@@ -879,3 +1818,38 @@ IndicatorNotificationsService *indicator_notifications_service_new()
 
     return INDICATOR_NOTIFICATIONS_SERVICE(o);
 }
+
+IndicatorNotificationsService *indicator_notifications_service_new_for_address(const gchar *sAddress)
+{
+    GObject *o = g_object_new(INDICATOR_TYPE_NOTIFICATIONS_SERVICE, "bus-address", sAddress, NULL);
+
+    return INDICATOR_NOTIFICATIONS_SERVICE(o);
+}
+
+void indicator_notifications_service_inject_message(IndicatorNotificationsService *self, GDBusMessage *message)
+{
+    g_return_if_fail(INDICATOR_IS_NOTIFICATIONS_SERVICE(self));
+
+    dbus_spy_inject_message(self->priv->pBusSpy, message);
+}
+
+guint indicator_notifications_service_get_queue_stats(IndicatorNotificationsService *self, guint *nHighWater)
+{
+    g_return_val_if_fail(INDICATOR_IS_NOTIFICATIONS_SERVICE(self), 0);
+
+    return dbus_spy_get_queue_stats(self->priv->pBusSpy, nHighWater);
+}
+
+GMenuModel *indicator_notifications_service_get_menu(IndicatorNotificationsService *self)
+{
+    g_return_val_if_fail(INDICATOR_IS_NOTIFICATIONS_SERVICE(self), NULL);
+
+    return G_MENU_MODEL(self->priv->lMenus[PROFILE_DESKTOP].pMenu);
+}
+
+GActionGroup *indicator_notifications_service_get_actions(IndicatorNotificationsService *self)
+{
+    g_return_val_if_fail(INDICATOR_IS_NOTIFICATIONS_SERVICE(self), NULL);
+
+    return G_ACTION_GROUP(self->priv->pActionGroup);
+}
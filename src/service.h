@@ -22,6 +22,7 @@
 
 #include <glib.h>
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -60,6 +61,21 @@ GType indicator_notifications_service_get_type (void);
 
 IndicatorNotificationsService *indicator_notifications_service_new();
 
+/* A service that watches the bus at the address and exports itself there, for running one per bus in one process */
+IndicatorNotificationsService *indicator_notifications_service_new_for_address(const gchar *address);
+
+/* Queues a captured Notify message as if the bus spy had seen it; it is handled with the next batch */
+void indicator_notifications_service_inject_message(IndicatorNotificationsService *self, GDBusMessage *message);
+
+/* The number of notifications dropped because too many waited for the main loop, and the most that waited at once */
+guint indicator_notifications_service_get_queue_stats(IndicatorNotificationsService *self, guint *high_water);
+
+/* The number of notifications from an application that were over its rate limit */
+
+/* The desktop menu and the actions behind it, as they are exported on the bus */
+GMenuModel *indicator_notifications_service_get_menu(IndicatorNotificationsService *self);
+GActionGroup *indicator_notifications_service_get_actions(IndicatorNotificationsService *self);
+
 G_END_DECLS
 
 #endif /* __INDICATOR_NOTIFICATIONS_SERVICE_H__ */
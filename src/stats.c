@@ -0,0 +1,200 @@
+/*
+ * stats.c - Cheap per-stage timing hooks and counters for the notification pipeline.
+ *
+ * Every stage duration lands in a log2 histogram and every counter is a
+ * single atomic integer, so both can be bumped from the GDBus worker thread
+ * and the main thread alike and read at any time.
+ *
+ * Built with ENABLE_TRACING, every stage and every stats_trace_end() also
+ * becomes a sysprof mark in the "notifications" group, as long as a capture
+ * is running. Timestamps are CLOCK_MONOTONIC nanoseconds, the same clock
+ * sysprof uses, so the marks line up with the rest of the recording.
+ */
+
+#include <time.h>
+#ifdef ENABLE_TRACING
+#include <sysprof-capture.h>
+#endif
+#include "stats.h"
+
+#define TRACE_GROUP "notifications"
+
+static const gchar *stage_names[STATS_N_STAGES] = {
+  "parse",
+  "filter",
+  "linkify",
+  "markup",
+  "menu"
+};
+
+static const gchar *counter_names[STATS_N_COUNTERS] = {
+  "received",
+  "filtered",
+  "private",
+  "empty",
+  "malformed",
+  "deduplicated",
+  "rate-limited",
+  "dropped"
+};
+
+static StatsStageFunc stage_func = NULL;
+static gpointer       stage_func_data = NULL;
+
+/* shared by every bus the process watches */
+static gint histograms[STATS_N_STAGES][STATS_HISTOGRAM_BUCKETS];
+static gint counters[STATS_N_COUNTERS];
+
+/**
+ * stats_now:
+ *
+ * Returns a monotonic timestamp in nanoseconds.
+ **/
+gint64
+stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((gint64) ts.tv_sec * G_GINT64_CONSTANT(1000000000)) + ts.tv_nsec;
+}
+
+/**
+ * stats_stage_name:
+ * @stage: the pipeline stage
+ *
+ * Returns a short, static name for the stage.
+ **/
+const gchar *
+stats_stage_name(StatsStage stage)
+{
+  g_return_val_if_fail(stage < STATS_N_STAGES, NULL);
+
+  return stage_names[stage];
+}
+
+/**
+ * stats_set_stage_func:
+ * @func: called with the duration of each completed stage, or NULL
+ * @user_data: passed to @func
+ *
+ * Installs an observer for every single stage duration. Only used by the
+ * benchmark harness, the histograms are kept either way.
+ **/
+void
+stats_set_stage_func(StatsStageFunc func, gpointer user_data)
+{
+  stage_func = func;
+  stage_func_data = user_data;
+}
+
+/**
+ * stats_stage_begin:
+ *
+ * Returns the start time to pass to stats_stage_end().
+ **/
+gint64
+stats_stage_begin(void)
+{
+  return stats_now();
+}
+
+/**
+ * stats_stage_end:
+ * @stage: the pipeline stage that just finished
+ * @start: the value returned by stats_stage_begin()
+ *
+ * Adds the duration of @stage to its histogram and reports it to the
+ * observer.
+ **/
+void
+stats_stage_end(StatsStage stage, gint64 start)
+{
+  gint64 elapsed = stats_now() - start;
+  guint bucket = elapsed > 1 ? g_bit_storage((gulong) MIN(elapsed, G_MAXUINT32)) - 1 : 0;
+
+  g_atomic_int_inc(&histograms[stage][bucket]);
+
+  if (stage_func != NULL)
+    stage_func(stage, elapsed, stage_func_data);
+
+#ifdef ENABLE_TRACING
+  if (sysprof_collector_is_active())
+    sysprof_collector_mark(start, elapsed, TRACE_GROUP, stage_names[stage], NULL);
+#endif
+}
+
+#ifdef ENABLE_TRACING
+/**
+ * stats_trace_begin:
+ *
+ * Returns the start time to pass to stats_trace_end(), or 0 when no capture
+ * is running.
+ **/
+gint64
+stats_trace_begin(void)
+{
+  return sysprof_collector_is_active() ? stats_now() : 0;
+}
+
+/**
+ * stats_trace_end:
+ * @name: a static name for the mark
+ * @start: the value returned by stats_trace_begin()
+ *
+ * Records a sysprof mark from @start until now.
+ **/
+void
+stats_trace_end(const gchar *name, gint64 start)
+{
+  if (start != 0)
+    sysprof_collector_mark(start, stats_now() - start, TRACE_GROUP, name, NULL);
+}
+#endif
+
+/**
+ * stats_get_histogram:
+ * @stage: the pipeline stage
+ * @buckets: filled with the number of durations in each bucket
+ *
+ * Reads the duration histogram of @stage, see STATS_HISTOGRAM_BUCKETS.
+ **/
+void
+stats_get_histogram(StatsStage stage, guint buckets[STATS_HISTOGRAM_BUCKETS])
+{
+  guint i;
+
+  g_return_if_fail(stage < STATS_N_STAGES);
+
+  for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    buckets[i] = (guint) g_atomic_int_get(&histograms[stage][i]);
+}
+
+/**
+ * stats_counter_name:
+ * @counter: a counter
+ *
+ * Returns a short, static name for the counter.
+ **/
+const gchar *
+stats_counter_name(StatsCounter counter)
+{
+  g_return_val_if_fail(counter < STATS_N_COUNTERS, NULL);
+
+  return counter_names[counter];
+}
+
+void
+stats_count(StatsCounter counter)
+{
+  g_atomic_int_inc(&counters[counter]);
+}
+
+guint
+stats_get_count(StatsCounter counter)
+{
+  g_return_val_if_fail(counter < STATS_N_COUNTERS, 0);
+
+  return (guint) g_atomic_int_get(&counters[counter]);
+}
@@ -0,0 +1,59 @@
+/*
+ * stats.h - Cheap per-stage timing hooks and counters for the notification pipeline.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  STATS_STAGE_PARSE,
+  STATS_STAGE_FILTER,
+  STATS_STAGE_LINKIFY,
+  STATS_STAGE_MARKUP,
+  STATS_STAGE_MENU,
+  STATS_N_STAGES
+} StatsStage;
+
+typedef enum {
+  STATS_COUNTER_RECEIVED,
+  STATS_COUNTER_FILTERED,
+  STATS_COUNTER_PRIVATE,
+  STATS_COUNTER_EMPTY,
+  STATS_COUNTER_MALFORMED,
+  STATS_COUNTER_DEDUPLICATED,
+  STATS_COUNTER_RATE_LIMITED,
+  STATS_COUNTER_DROPPED,
+  STATS_N_COUNTERS
+} StatsCounter;
+
+/* bucket i counts stages that took from 2^i up to 2^(i+1) nanoseconds */
+#define STATS_HISTOGRAM_BUCKETS 32
+
+typedef void (*StatsStageFunc)(StatsStage stage, gint64 elapsed_ns, gpointer user_data);
+
+gint64       stats_now(void);
+const gchar *stats_stage_name(StatsStage stage);
+void         stats_set_stage_func(StatsStageFunc func, gpointer user_data);
+gint64       stats_stage_begin(void);
+void         stats_stage_end(StatsStage stage, gint64 start);
+void         stats_get_histogram(StatsStage stage, guint buckets[STATS_HISTOGRAM_BUCKETS]);
+const gchar *stats_counter_name(StatsCounter counter);
+void         stats_count(StatsCounter counter);
+guint        stats_get_count(StatsCounter counter);
+
+/* sysprof marks for work that is not a stage, gone entirely without ENABLE_TRACING */
+#ifdef ENABLE_TRACING
+gint64       stats_trace_begin(void);
+void         stats_trace_end(const gchar *name, gint64 start);
+#else
+#define stats_trace_begin() G_GINT64_CONSTANT(0)
+#define stats_trace_end(name, start) G_STMT_START { (void) (start); } G_STMT_END
+#endif
+
+G_END_DECLS
+
+#endif /* __STATS_H__ */
@@ -19,13 +19,6 @@
 #define USERPASS USERCHARS_CLASS "+(?:" PASSCHARS_CLASS "+)?"
 #define URLPATH   "(?:(/"PATHCHARS_CLASS"+(?:[(]"PATHCHARS_CLASS"*[)])*"PATHCHARS_CLASS"*)*"PATHTERM_CLASS")?"
 
-typedef enum {
-  FLAVOR_AS_IS,
-  FLAVOR_DEFAULT_TO_HTTP,
-  FLAVOR_EMAIL,
-  FLAVOR_LP
-} UrlRegexFlavor;
-
 typedef struct {
   const char        *pattern;
   UrlRegexFlavor     flavor;
@@ -39,23 +32,34 @@ static UrlRegexPattern url_regex_patterns[] = {
   { "(?:lp: #)([[:digit:]]+)", FLAVOR_LP, G_REGEX_CASELESS}
 };
 
+#define LP_PREFIX "lp: #"
+
 static GRegex         **url_regexes;
 static UrlRegexFlavor  *url_regex_flavors;
 static guint            n_url_regexes;
 
+static guint64          scan_budget = URLREGEX_DEFAULT_STEP_BUDGET;
+static gint             scan_budget_hits = 0;
+static gint             prefilter_hits = 0;
+static gint             prefilter_skips = 0;
+
 static char *urlregex_expand(GMatchInfo *match_info, UrlRegexFlavor flavor);
 
 /**
  * urlregex_init:
  *
- * Compiles all of the url matching regular expressions.
- * FIXME: Return immediately or error if initialized more than once
+ * Compiles all of the url matching regular expressions. Only the first call
+ * does anything. urlregex_scan() does not need them.
  **/
 void
 urlregex_init(void)
 {
+  static gsize initialized = 0;
   guint i;
 
+  if (!g_once_init_enter(&initialized))
+    return;
+
   n_url_regexes = G_N_ELEMENTS(url_regex_patterns);
   url_regexes = g_new0(GRegex*, n_url_regexes);
   url_regex_flavors = g_new0(UrlRegexFlavor, n_url_regexes);
@@ -73,6 +77,567 @@ urlregex_init(void)
 
     url_regex_flavors[i] = url_regex_patterns[i].flavor;
   }
+
+  g_once_init_leave(&initialized, 1);
+}
+
+/*
+ * A hand-written scanner for the same four patterns. The nested quantifiers
+ * in URLPATH make the regular expressions backtrack badly on bodies full of
+ * slashes and parentheses, while this never looks back more than a few
+ * characters and remembers the runs it already measured, so its work is
+ * linear in the length of the body: a run is read once however many of the
+ * positions inside it a lookup starts from, and every start position in the
+ * user part of an email address shares the result for its '@'. Every
+ * character read counts against a budget, and a body that exhausts it gets
+ * no links at all.
+ *
+ * The one deliberate difference is the path: it is the longest run of path
+ * characters after a slash, with parentheses balanced and trailing
+ * punctuation dropped, which is what the backtracking was approximating.
+ */
+typedef struct {
+  gsize start;
+  gsize end;
+} UrlRun;
+
+typedef struct {
+  const char *text;
+  gsize       length;
+  guint64     steps;
+  guint64     budget;
+  gboolean    exhausted;
+
+  /* the last run of each character class that was measured */
+  UrlRun      host_run;
+  UrlRun      user_run;
+  UrlRun      pass_run;
+
+  /* the host after the last '@' looked at, 0 for none as an '@' there has no user part */
+  gsize       email_at;
+  gsize       email_end;
+  gboolean    email_found;
+} UrlScanner;
+
+static const char *url_schemes[] = {
+  "news:", "telnet:", "nntp:", "file:/", "http:", "https:", "ftp:", "ftps:", "sftp:", "webcal:"
+};
+
+/* reads one character, or 0 past the end or once the budget is gone */
+static inline char
+scanner_peek(UrlScanner *scanner, gsize pos)
+{
+  if (pos >= scanner->length)
+    return 0;
+
+  if (++scanner->steps > scanner->budget) {
+    scanner->exhausted = TRUE;
+    scanner->length = 0;
+    return 0;
+  }
+
+  return scanner->text[pos];
+}
+
+static gboolean
+is_hostchar(char c)
+{
+  return g_ascii_isalnum(c) || c == '-';
+}
+
+static gboolean
+is_userchar(char c)
+{
+  return is_hostchar(c) || c == '.';
+}
+
+static gboolean
+is_passchar(char c)
+{
+  return c != 0 && (g_ascii_isalnum(c) || strchr("-,?;.:/!%$^*&~\"#'", c) != NULL);
+}
+
+static gboolean
+is_pathchar(char c)
+{
+  return c != 0 && (g_ascii_isalnum(c) || strchr("-_$.+!*,:;@&=?/~#%", c) != NULL);
+}
+
+static gboolean
+scanner_has_prefix(UrlScanner *scanner, gsize pos, const char *prefix)
+{
+  for (; *prefix != '\0'; prefix++, pos++) {
+    if (g_ascii_tolower(scanner_peek(scanner, pos)) != *prefix)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* end of the run of characters starting at pos, reusing the last one measured */
+static gsize
+scanner_run(UrlScanner *scanner, gsize pos, UrlRun *run, gboolean (*is_member)(char c))
+{
+  gsize end = pos;
+
+  if (pos >= run->start && pos < run->end)
+    return run->end;
+
+  while (is_member(scanner_peek(scanner, end)))
+    end++;
+
+  run->start = pos;
+  run->end = end;
+
+  return end;
+}
+
+#define scanner_host_run(scanner, pos) scanner_run(scanner, pos, &(scanner)->host_run, is_hostchar)
+#define scanner_user_run(scanner, pos) scanner_run(scanner, pos, &(scanner)->user_run, is_userchar)
+#define scanner_pass_run(scanner, pos) scanner_run(scanner, pos, &(scanner)->pass_run, is_passchar)
+
+/* HOST: labels of host characters separated by single dots */
+static gboolean
+scanner_host(UrlScanner *scanner, gsize pos, gsize *end)
+{
+  gsize p = scanner_host_run(scanner, pos);
+
+  if (p == pos)
+    return FALSE;
+
+  while (scanner_peek(scanner, p) == '.' && is_hostchar(scanner_peek(scanner, p + 1)))
+    p = scanner_host_run(scanner, p + 1);
+
+  *end = p;
+
+  return TRUE;
+}
+
+/* PORT: a colon and up to five digits */
+static gsize
+scanner_port(UrlScanner *scanner, gsize pos)
+{
+  gsize p = pos + 1;
+
+  if (scanner_peek(scanner, pos) != ':')
+    return pos;
+
+  while (p < pos + 6 && g_ascii_isdigit(scanner_peek(scanner, p)))
+    p++;
+
+  return p > pos + 1 ? p : pos;
+}
+
+/* URLPATH, see above */
+static gsize
+scanner_path(UrlScanner *scanner, gsize pos)
+{
+  gsize p = pos;
+  gsize open = 0;
+  guint depth = 0;
+  char c;
+
+  if (scanner_peek(scanner, pos) != '/')
+    return pos;
+
+  for (c = scanner_peek(scanner, p); c != 0; c = scanner_peek(scanner, ++p)) {
+    if (c == '(') {
+      if (depth++ == 0)
+        open = p;
+    }
+    else if (c == ')') {
+      if (depth == 0)
+        break;
+      depth--;
+    }
+    else if (!is_pathchar(c)) {
+      break;
+    }
+  }
+
+  /* an unclosed parenthesis is not part of the url */
+  if (depth > 0)
+    p = open;
+
+  while (p > pos + 1 && strchr(".:,", scanner->text[p - 1]) != NULL)
+    p--;
+
+  return p;
+}
+
+static gboolean
+scanner_url(UrlScanner *scanner, gsize pos, gsize *end)
+{
+  char first = g_ascii_tolower(scanner->text[pos]);
+  gsize p = 0;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(url_schemes) && p == 0; i++) {
+    if (url_schemes[i][0] == first
+        && scanner_has_prefix(scanner, pos, url_schemes[i])
+        && scanner_has_prefix(scanner, pos + strlen(url_schemes[i]), "//"))
+      p = pos + strlen(url_schemes[i]) + 2;
+  }
+
+  if (p == 0)
+    return FALSE;
+
+  /* USERPASS@ */
+  if (is_hostchar(scanner_peek(scanner, p))) {
+    gsize q = scanner_pass_run(scanner, p);
+
+    if (scanner_peek(scanner, q) == '@')
+      p = q + 1;
+  }
+
+  if (!scanner_host(scanner, p, &p))
+    return FALSE;
+
+  *end = scanner_path(scanner, scanner_port(scanner, p));
+
+  return TRUE;
+}
+
+static gboolean
+scanner_www(UrlScanner *scanner, gsize pos, gsize *end)
+{
+  gsize p;
+
+  if (!scanner_has_prefix(scanner, pos, "www") && !scanner_has_prefix(scanner, pos, "ftp"))
+    return FALSE;
+
+  p = scanner_host_run(scanner, pos + 3);
+
+  if (scanner_peek(scanner, p) != '.' || !scanner_host(scanner, p + 1, &p))
+    return FALSE;
+
+  *end = scanner_path(scanner, scanner_port(scanner, p));
+
+  return TRUE;
+}
+
+static gboolean
+scanner_email(UrlScanner *scanner, gsize pos, gsize *end)
+{
+  gsize p = pos;
+
+  if (scanner_has_prefix(scanner, p, MAILTO_BASE_URL))
+    p += strlen(MAILTO_BASE_URL);
+
+  if (!is_hostchar(scanner_peek(scanner, p)))
+    return FALSE;
+
+  p = scanner_user_run(scanner, p);
+
+  if (scanner_peek(scanner, p) != '@')
+    return FALSE;
+
+  /* every start in the user run gets here, so look at the host only once */
+  if (scanner->email_at == p) {
+    *end = scanner->email_end;
+    return scanner->email_found;
+  }
+
+  scanner->email_at = p;
+  scanner->email_found = FALSE;
+
+  /* at least two labels after the @ */
+  gsize label = scanner_host_run(scanner, p + 1);
+
+  if (label == p + 1 || scanner_peek(scanner, label) != '.' || !is_hostchar(scanner_peek(scanner, label + 1)))
+    return FALSE;
+
+  scanner->email_found = scanner_host(scanner, p + 1, &scanner->email_end);
+  *end = scanner->email_end;
+
+  return scanner->email_found;
+}
+
+static gboolean
+scanner_lp(UrlScanner *scanner, gsize pos, gsize *end)
+{
+  gsize p = pos + strlen(LP_PREFIX);
+
+  if (!scanner_has_prefix(scanner, pos, LP_PREFIX))
+    return FALSE;
+
+  while (g_ascii_isdigit(scanner_peek(scanner, p)))
+    p++;
+
+  if (p == pos + strlen(LP_PREFIX))
+    return FALSE;
+
+  *end = p;
+
+  return TRUE;
+}
+
+/*
+ * Every pattern needs a ':' (the schemes, mailto: and lp: #), an '@' or a
+ * "www" or "ftp" somewhere before a dot. Looking for those bytes a word at a
+ * time rules out most bodies long before the scanner would.
+ */
+#define ONES  G_GUINT64_CONSTANT(0x0101010101010101)
+#define HIGHS G_GUINT64_CONSTANT(0x8080808080808080)
+
+/* non-zero if any byte of word equals byte */
+static inline guint64
+word_has_byte(guint64 word, guchar byte)
+{
+  guint64 x = word ^ (ONES * byte);
+
+  return (x - ONES) & ~x & HIGHS;
+}
+
+static gboolean
+is_www_or_ftp(const char *text)
+{
+  return (g_ascii_tolower(text[0]) == 'w' && g_ascii_tolower(text[1]) == 'w' && g_ascii_tolower(text[2]) == 'w')
+    || (g_ascii_tolower(text[0]) == 'f' && g_ascii_tolower(text[1]) == 't' && g_ascii_tolower(text[2]) == 'p');
+}
+
+/* whether the host characters before the dot at pos contain "www" or "ftp" */
+static gboolean
+dot_follows_www_or_ftp(const char *text, gsize pos)
+{
+  gsize start = pos;
+
+  while (start > 0 && is_hostchar(text[start - 1]))
+    start--;
+
+  for (; start + 3 <= pos; start++) {
+    if (is_www_or_ftp(text + start))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+may_contain_links(const char *text, gsize length)
+{
+  gsize pos = 0;
+
+  while (pos < length) {
+    gsize end = MIN(pos + sizeof(guint64), length);
+
+    if (end - pos == sizeof(guint64)) {
+      guint64 word;
+
+      memcpy(&word, text + pos, sizeof word);
+
+      if (!word_has_byte(word, ':') && !word_has_byte(word, '@') && !word_has_byte(word, '.')) {
+        pos = end;
+        continue;
+      }
+    }
+
+    for (; pos < end; pos++) {
+      if (text[pos] == ':' || text[pos] == '@')
+        return TRUE;
+      if (text[pos] == '.' && dot_follows_www_or_ftp(text, pos))
+        return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+ * urlregex_may_contain_links:
+ * @text: the text to look at, need not be terminated
+ * @length: the length of @text in bytes
+ *
+ * Quickly rules out texts that cannot contain any url. If this returns
+ * FALSE, urlregex_scan() would find nothing.
+ **/
+gboolean
+urlregex_may_contain_links(const char *text, gsize length)
+{
+  if (may_contain_links(text, length)) {
+    g_atomic_int_inc(&prefilter_hits);
+    return TRUE;
+  }
+
+  g_atomic_int_inc(&prefilter_skips);
+  return FALSE;
+}
+
+/**
+ * urlregex_get_prefilter_stats:
+ * @hits: (out) (optional): texts that had to be scanned
+ * @skips: (out) (optional): texts that were ruled out
+ *
+ * Reports what urlregex_may_contain_links() decided so far.
+ **/
+void
+urlregex_get_prefilter_stats(guint *hits, guint *skips)
+{
+  if (hits != NULL)
+    *hits = (guint) g_atomic_int_get(&prefilter_hits);
+  if (skips != NULL)
+    *skips = (guint) g_atomic_int_get(&prefilter_skips);
+}
+
+static guint
+scan(const char *text, gsize length, guint64 budget, GArray *spans, guint64 *steps)
+{
+  UrlScanner scanner = { 0, };
+  guint first = spans->len;
+  gsize pos = 0;
+
+  scanner.text = text;
+  scanner.length = length;
+  scanner.budget = budget;
+
+  while (pos < scanner.length) {
+    char c = scanner_peek(&scanner, pos);
+    UrlSpan span;
+    gsize end = 0;
+
+    /* the patterns in the order the regular expressions were tried */
+    if (g_ascii_isalpha(c) && scanner_url(&scanner, pos, &end))
+      span.flavor = FLAVOR_AS_IS;
+    else if ((c == 'w' || c == 'W' || c == 'f' || c == 'F') && scanner_www(&scanner, pos, &end))
+      span.flavor = FLAVOR_DEFAULT_TO_HTTP;
+    else if (is_hostchar(c) && scanner_email(&scanner, pos, &end))
+      span.flavor = FLAVOR_EMAIL;
+    else if ((c == 'l' || c == 'L') && scanner_lp(&scanner, pos, &end))
+      span.flavor = FLAVOR_LP;
+
+    if (end > pos && !scanner.exhausted) {
+      span.start = pos;
+      span.length = end - pos;
+      g_array_append_val(spans, span);
+      pos = end;
+    }
+    else {
+      pos++;
+    }
+  }
+
+  if (steps != NULL)
+    *steps = scanner.steps;
+
+  if (scanner.exhausted) {
+    g_atomic_int_inc(&scan_budget_hits);
+    g_array_set_size(spans, first);
+    return 0;
+  }
+
+  return spans->len - first;
+}
+
+/**
+ * urlregex_scan:
+ * @text: the text to scan, need not be terminated
+ * @length: the length of @text in bytes
+ * @spans: a GArray of UrlSpan to append to
+ *
+ * Finds all urls in a single pass over the text. The spans point into
+ * @text and follow each other in order. If the text needs more work than
+ * the step budget allows, nothing is appended. Returns the number of spans
+ * found.
+ **/
+guint
+urlregex_scan(const char *text, gsize length, GArray *spans)
+{
+  return scan(text, length, scan_budget, spans, NULL);
+}
+
+/**
+ * urlregex_count_steps:
+ * @text: the text to scan, need not be terminated
+ * @length: the length of @text in bytes
+ *
+ * Returns how many characters urlregex_scan() reads for the text when the
+ * budget does not stop it, for checking that the work grows linearly.
+ **/
+guint64
+urlregex_count_steps(const char *text, gsize length)
+{
+  GArray *spans = g_array_new(FALSE, FALSE, sizeof(UrlSpan));
+  guint64 steps = 0;
+
+  scan(text, length, G_MAXUINT64, spans, &steps);
+  g_array_unref(spans);
+
+  return steps;
+}
+
+/**
+ * urlregex_set_step_budget:
+ * @budget: the most characters urlregex_scan() may read for one text
+ *
+ * Bounds the time spent looking for urls in a single text.
+ **/
+void
+urlregex_set_step_budget(guint64 budget)
+{
+  scan_budget = MAX(budget, 1);
+}
+
+/**
+ * urlregex_get_budget_hits:
+ *
+ * Returns how many texts ran out of budget and were left without links.
+ **/
+guint
+urlregex_get_budget_hits(void)
+{
+  return (guint) g_atomic_int_get(&scan_budget_hits);
+}
+
+/**
+ * urlregex_span_target:
+ * @text: the text that was scanned
+ * @span: a span found in @text
+ * @rest: (out): the part of @text that follows the prefix in the url
+ * @rest_length: (out): the length of @rest in bytes
+ *
+ * Splits the url a span links to into a constant prefix, which is returned,
+ * and a part of @text, so the url can be written out without building it.
+ **/
+const char *
+urlregex_span_target(const char *text, const UrlSpan *span, const char **rest, gsize *rest_length)
+{
+  const char *start = text + span->start;
+
+  *rest = start;
+  *rest_length = span->length;
+
+  switch(span->flavor) {
+    case FLAVOR_DEFAULT_TO_HTTP:
+      return HTTP_BASE_URL;
+    case FLAVOR_EMAIL:
+      if (span->length >= strlen(MAILTO_BASE_URL) && g_ascii_strncasecmp(start, MAILTO_BASE_URL, strlen(MAILTO_BASE_URL)) == 0)
+        return "";
+      return MAILTO_BASE_URL;
+    case FLAVOR_LP:
+      *rest = start + strlen(LP_PREFIX);
+      *rest_length = span->length - strlen(LP_PREFIX);
+      return LP_BUG_BASE_URL;
+    default:
+      return "";
+  }
+}
+
+/**
+ * urlregex_span_expand:
+ * @text: the text that was scanned
+ * @span: a span found in @text
+ *
+ * Returns the url a span links to, such as a mailto: url for an email
+ * address.
+ **/
+char *
+urlregex_span_expand(const char *text, const UrlSpan *span)
+{
+  const char *rest;
+  gsize rest_length;
+  const char *prefix = urlregex_span_target(text, span, &rest, &rest_length);
+
+  return g_strdup_printf("%s%.*s", prefix, (int) rest_length, rest);
 }
 
 /**
@@ -83,6 +648,8 @@ urlregex_init(void)
 guint
 urlregex_count(void)
 {
+  urlregex_init();
+
   return n_url_regexes;
 }
 
@@ -97,7 +664,7 @@ GList *
 urlregex_split(const char *text, guint index)
 {
   GList *result = NULL;
-  GRegex *pattern = url_regexes[index];
+  GRegex *pattern;
   GMatchInfo *match_info;
   int text_length = strlen(text);
 
@@ -109,38 +676,39 @@ urlregex_split(const char *text, guint index)
   gchar *token;
   gchar *expanded;
 
+  urlregex_init();
+  g_return_val_if_fail(index < n_url_regexes, NULL);
+  pattern = url_regexes[index];
+
   g_regex_match(pattern, text, 0, &match_info);
 
   while (g_match_info_matches(match_info)) {
-    /* Append previously unmatched text */
+    /* Prepend previously unmatched text */
     g_match_info_fetch_pos(match_info, 0, &start_pos, &end_pos);
     len = start_pos - last_pos;
     if (len > 0) {
       token = g_strndup(text + last_pos, len);
-      result = g_list_append(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
+      result = g_list_prepend(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
       g_free(token);
     }
 
-    /* Append matched text */
+    /* Prepend matched text */
     token = urlregex_expand(match_info, FLAVOR_AS_IS);
     expanded = urlregex_expand(match_info, url_regex_flavors[index]);
-    result = g_list_append(result, urlregex_matchgroup_new(token, expanded, MATCHED));
+    result = g_list_prepend(result, urlregex_matchgroup_new(token, expanded, MATCHED));
     g_free(token);
     g_free(expanded);
 
     g_match_info_next(match_info, NULL);
     last_pos = end_pos;
   }
-  /* Append the text after the last match */
-  if (last_pos < text_length) {
-    token = g_strdup(text + last_pos);
-    result = g_list_append(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
-    g_free(token);
-  }
+  /* Prepend the text after the last match */
+  if (last_pos < text_length)
+    result = g_list_prepend(result, urlregex_matchgroup_new(text + last_pos, text + last_pos, NOT_MATCHED));
 
   g_match_info_free(match_info);
 
-  return result;
+  return g_list_reverse(result);
 }
 
 /**
@@ -185,43 +753,50 @@ urlregex_expand(GMatchInfo *match_info, UrlRegexFlavor flavor)
  * urlregex_split_all:
  * @text: the text to split
  *
- * Splits the text into a list of MatchGroup objects, applying each url pattern
- * available in order to each of the unmatched sections, keeping the list flat.
+ * Splits the text into a list of MatchGroup objects, one per url and one per
+ * stretch of text between them. Kept for compatibility, urlregex_scan() does
+ * the same without copying anything.
  **/
 GList *
 urlregex_split_all(const char *text)
 {
+  GArray *spans = g_array_new(FALSE, FALSE, sizeof(UrlSpan));
   GList *result = NULL;
-  GList *temp = NULL;
+  gsize length = strlen(text);
+  gsize last_pos = 0;
+  gchar *token;
+  gchar *expanded;
   guint i;
 
-  result = g_list_append(result, urlregex_matchgroup_new(text, text, NOT_MATCHED));
+  urlregex_scan(text, length, spans);
 
-  /* Apply each regex in order to sections that haven't yet been matched */
-  for (i = 0; i < n_url_regexes; i++) {
-    GList *item;
-    temp = NULL;
-    for (item = result; item; item = item->next) {
-      MatchGroup *group = (MatchGroup *)item->data;
-      if (group->type == NOT_MATCHED) {
-        GList *list = urlregex_split(group->text, i);
-        GList *subitem;
-        for (subitem = list; subitem; subitem = subitem->next) {
-          MatchGroup *subgroup = (MatchGroup *)subitem->data;
-          temp = g_list_append(temp, subgroup);
-        }
-        g_list_free(list);
-        urlregex_matchgroup_free(group);
-      }
-      else {
-        temp = g_list_append(temp, group);
-      }
+  for (i = 0; i < spans->len; i++) {
+    UrlSpan *span = &g_array_index(spans, UrlSpan, i);
+
+    /* Prepend previously unmatched text */
+    if (span->start > last_pos) {
+      token = g_strndup(text + last_pos, span->start - last_pos);
+      result = g_list_prepend(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
+      g_free(token);
     }
-    g_list_free(result);
-    result = temp;
+
+    /* Prepend matched text */
+    token = g_strndup(text + span->start, span->length);
+    expanded = urlregex_span_expand(text, span);
+    result = g_list_prepend(result, urlregex_matchgroup_new(token, expanded, MATCHED));
+    g_free(token);
+    g_free(expanded);
+
+    last_pos = span->start + span->length;
   }
 
-  return result;
+  /* Prepend the text after the last match */
+  if (last_pos < length || result == NULL)
+    result = g_list_prepend(result, urlregex_matchgroup_new(text + last_pos, text + last_pos, NOT_MATCHED));
+
+  g_array_unref(spans);
+
+  return g_list_reverse(result);
 }
 
 /**
@@ -230,15 +805,15 @@ urlregex_split_all(const char *text)
  * @expanded: the expanded url
  * @type: whether this is a matched or unmatched group
  *
- * Creates a new MatchGroup object.
+ * Creates a new MatchGroup object. If @expanded is the same as @text, both
+ * fields point to one copy.
  **/
 MatchGroup *
 urlregex_matchgroup_new(const char *text, const char *expanded, MatchType type)
 {
   MatchGroup *result = g_new0(MatchGroup, 1);
   result->text = g_strdup(text);
-  /* TODO: Save space using same data if text == expanded? */
-  result->expanded = g_strdup(expanded);
+  result->expanded = g_strcmp0(text, expanded) == 0 ? result->text : g_strdup(expanded);
   result->type = type;
   return result;
 }
@@ -252,7 +827,8 @@ urlregex_matchgroup_new(const char *text, const char *expanded, MatchType type)
 void
 urlregex_matchgroup_free(MatchGroup *group)
 {
-  g_free(group->expanded);
+  if (group->expanded != group->text)
+    g_free(group->expanded);
   group->expanded = NULL;
   g_free(group->text);
   group->text = NULL;
@@ -12,14 +12,39 @@ typedef enum {
   NOT_MATCHED
 } MatchType;
 
+/* expanded points to text when the two are the same */
 typedef struct {
   char       *text;
   char       *expanded;
   MatchType   type;
 } MatchGroup;
 
+typedef enum {
+  FLAVOR_AS_IS,
+  FLAVOR_DEFAULT_TO_HTTP,
+  FLAVOR_EMAIL,
+  FLAVOR_LP
+} UrlRegexFlavor;
+
+/* a url inside a scanned text, in bytes */
+typedef struct {
+  gsize          start;
+  gsize          length;
+  UrlRegexFlavor flavor;
+} UrlSpan;
+
+#define URLREGEX_DEFAULT_STEP_BUDGET 1000000
+
 void   urlregex_init(void);
 guint  urlregex_count(void);
+gboolean urlregex_may_contain_links(const char *text, gsize length);
+void   urlregex_get_prefilter_stats(guint *hits, guint *skips);
+guint  urlregex_scan(const char *text, gsize length, GArray *spans);
+guint64 urlregex_count_steps(const char *text, gsize length);
+void   urlregex_set_step_budget(guint64 budget);
+guint  urlregex_get_budget_hits(void);
+const char *urlregex_span_target(const char *text, const UrlSpan *span, const char **rest, gsize *rest_length);
+char  *urlregex_span_expand(const char *text, const UrlSpan *span);
 GList *urlregex_split(const char *text, guint index);
 GList *urlregex_split_all(const char *text);
 